@@ -0,0 +1,158 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include "queue.h"
+#include "subscription.h"
+
+const size_t SESSION_MAX_INBOUND = 64 * 1024;
+const size_t SESSION_MAX_OUTSTANDING = 256 * 1024;
+const boost::posix_time::seconds SESSION_WRITE_TIMEOUT(10);
+
+// Limits shared by every loop. A session reads nothing while a command is in
+// progress or while more than _max_outstanding bytes of its output wait for
+// the peer, so it never holds more than _max_inbound of an unfinished line
+// and about _max_outstanding of unsent output.
+struct Limits {
+    size_t _max_connections;
+    size_t _max_inbound;
+    size_t _max_outstanding;
+    std::atomic<size_t> _connections;
+
+    Limits() : _max_connections(0), _max_inbound(SESSION_MAX_INBOUND), _max_outstanding(SESSION_MAX_OUTSTANDING), _connections(0) {}
+
+    // 0 connections means no limit
+    bool admit()
+    {
+        size_t n = ++_connections;
+        if(_max_connections == 0 || n <= _max_connections)
+            return true;
+        --_connections;
+        return false;
+    }
+
+    void leave()
+    {
+        --_connections;
+    }
+};
+
+// All output of a session goes through here, on the session strand. Writes
+// are queued and sent in batches, records without a copy. A write suspends
+// the session only while more than _max_outstanding bytes wait for the peer,
+// a peer that takes nothing for SESSION_WRITE_TIMEOUT gets disconnected.
+// The kernel socket buffer keeps its own autotuned size.
+template<typename Stream>
+class Outbound : public std::enable_shared_from_this<Outbound<Stream>>
+{
+private:
+    Stream& _stream;
+    boost::asio::io_service::strand& _strand;
+    boost::asio::deadline_timer _stall;
+    size_t _max_outstanding;
+
+    std::vector<Encoded> _queued;
+    std::vector<Encoded> _sending;
+    std::vector<boost::asio::const_buffer> _buffers;
+    size_t _outstanding;
+    Signal _room;
+
+    bool _writing;
+    bool _stalled;
+    bool _closed;
+    boost::system::error_code _error;
+
+    void flush()
+    {
+        _sending.swap(_queued);
+        _buffers.clear();
+        for(auto& data : _sending)
+            _buffers.push_back(boost::asio::buffer(data._wire.data(), data._wire.size()));
+
+        _writing = true;
+        _stall.expires_from_now(SESSION_WRITE_TIMEOUT);
+
+        // the session may be gone when the timer fires, _closed tells
+        auto self(this->shared_from_this());
+        _stall.async_wait(_strand.wrap([this, self](const boost::system::error_code& ec) {
+            if(ec || _closed || !_writing || _stall.expires_at() > boost::asio::deadline_timer::traits_type::now())
+                return;
+            _stalled = true;
+            boost::system::error_code ignored;
+            _stream.close(ignored);
+        }));
+
+        boost::asio::async_write(_stream, _buffers, _strand.wrap([this, self](const boost::system::error_code& ec, size_t bytes) {
+            _writing = false;
+            _stall.cancel();
+            _outstanding -= bytes;
+            _sending.clear();
+            if(ec)
+                _error = ec;
+            else if(_closed)
+                _error = boost::asio::error::operation_aborted;
+            else if(!_queued.empty())
+                flush();
+            _room.notify();
+        }));
+    }
+
+public:
+    Outbound(Stream& stream, boost::asio::io_service::strand& strand, size_t max_outstanding) :
+        _stream(stream),
+        _strand(strand),
+        _stall(strand.get_io_service()),
+        _max_outstanding(max_outstanding),
+        _outstanding(0),
+        _room(strand.get_io_service()),
+        _writing(false),
+        _stalled(false),
+        _closed(false)
+    {}
+
+    bool stalled() const
+    {
+        return _stalled;
+    }
+
+    // ec reports the first failed write, which may be an earlier one
+    void write(Encoded data, boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        if(!_error && !_closed) {
+            _outstanding += data._wire.size();
+            _queued.push_back(std::move(data));
+            if(!_writing)
+                flush();
+        }
+
+        while(!_error && _outstanding > _max_outstanding)
+            _room.wait(yield);
+        ec = _error;
+    }
+
+    void write(std::string data, boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        write(encode(std::move(data)), yield, ec);
+    }
+
+    // waits until the peer took everything or the connection failed
+    void drain(boost::asio::yield_context& yield, boost::system::error_code& ec)
+    {
+        while(!_error && _outstanding > 0)
+            _room.wait(yield);
+        ec = _error;
+    }
+
+    // the stream is going away, whatever is in flight completes with an error
+    void close()
+    {
+        _closed = true;
+        _stall.cancel();
+    }
+};
@@ -0,0 +1,339 @@
+#include "../bin/version.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include <boost/filesystem.hpp>
+
+#include "queue.h"
+
+// every allocation made by the process goes through here, so allocs/op is
+// the number of operator new calls observed between two probes
+static size_t g_allocs = 0;
+
+void* operator new(size_t size)
+{
+    ++g_allocs;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if(p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+// read and write class syscalls issued by the process, as accounted by the
+// kernel in /proc/self/io; open, close, fsync and rename are not counted
+// there, so the column is rw-syscalls and not every syscall
+size_t rw_syscalls()
+{
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    size_t value;
+    size_t total = 0;
+    while(in >> key >> value)
+        if(key == "syscr:" || key == "syscw:")
+            total += value;
+    return total;
+}
+
+struct Probe {
+    std::chrono::steady_clock::time_point _time;
+    size_t _allocs;
+    size_t _syscalls;
+
+    Probe() : _time(std::chrono::steady_clock::now()), _allocs(g_allocs), _syscalls(rw_syscalls()) {}
+};
+
+struct Bench {
+    size_t _allocs_overhead;
+    size_t _syscalls_overhead;
+
+    Bench()
+    {
+        // probing itself reads /proc and allocates, measure it once to subtract
+        Probe a;
+        Probe b;
+        _allocs_overhead = b._allocs - a._allocs;
+        _syscalls_overhead = b._syscalls - a._syscalls;
+    }
+
+    void report(const std::string& name, const Probe& start, const Probe& finish, size_t ops)
+    {
+        if(ops == 0)
+            ops = 1;
+
+        double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(finish._time - start._time).count();
+        size_t allocs = finish._allocs - start._allocs;
+        size_t sys = finish._syscalls - start._syscalls;
+        allocs = allocs > _allocs_overhead ? allocs - _allocs_overhead : 0;
+        sys = sys > _syscalls_overhead ? sys - _syscalls_overhead : 0;
+
+        std::cout << std::left << std::setw(40) << name << std::right << std::fixed
+                  << std::setw(12) << std::setprecision(0) << ns / ops << " ns/op"
+                  << std::setw(10) << std::setprecision(2) << double(allocs) / ops << " allocs/op"
+                  << std::setw(10) << std::setprecision(2) << double(sys) / ops << " rw-syscalls/op"
+                  << std::setw(10) << ops << " ops" << std::endl;
+    }
+};
+
+struct DataSet {
+    size_t _queues;
+    size_t _blocks;
+    size_t _block_size;
+    size_t _tail;
+    size_t _record_size;
+
+    std::string name() const
+    {
+        return
+            "q" + std::to_string(_queues) +
+            ".b" + std::to_string(_blocks) + "x" + std::to_string(_block_size) +
+            ".t" + std::to_string(_tail) +
+            ".r" + std::to_string(_record_size);
+    }
+
+    static std::string queue_name(size_t n)
+    {
+        return "q" + std::to_string(n);
+    }
+
+    std::string record(size_t pos) const
+    {
+        return std::string(_record_size, 'a' + pos % 26);
+    }
+
+    void write_block(const std::string& name, size_t first, size_t last) const
+    {
+        std::string stem = name + "." + std::to_string(first) + "." + std::to_string(last);
+        std::ofstream out((QUEUES_DIR / (stem + ".rec")).c_str());
+        for(size_t pos = first; pos <= last; ++pos)
+            out << record(pos) << "\n";
+    }
+
+    void write() const
+    {
+        for(size_t q = 0; q < _queues; ++q) {
+            size_t pos = 0;
+            for(size_t b = 0; b < _blocks; ++b, pos += _block_size)
+                write_block(queue_name(q), pos, pos + _block_size - 1);
+            for(size_t t = 0; t < _tail; ++t, ++pos)
+                write_block(queue_name(q), pos, pos);
+        }
+    }
+};
+
+class TempDir
+{
+private:
+    boost::filesystem::path _prev;
+    boost::filesystem::path _path;
+
+public:
+    TempDir() :
+        _prev(boost::filesystem::current_path()),
+        _path(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("rq_bench-%%%%-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(_path);
+        // QUEUES_DIR is relative to the working directory
+        boost::filesystem::current_path(_path);
+    }
+
+    ~TempDir()
+    {
+        boost::filesystem::current_path(_prev);
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(_path, ec);
+    }
+};
+
+// Queues::load is chatty on std::cerr, keep it out of the numbers
+class Silence
+{
+private:
+    std::ostringstream _sink;
+    std::streambuf* _prev;
+
+public:
+    Silence() : _prev(std::cerr.rdbuf(_sink.rdbuf())) {}
+    ~Silence()
+    {
+        std::cerr.rdbuf(_prev);
+    }
+};
+
+void bench_push(Bench& b, const DataSet& ds)
+{
+    TempDir td;
+
+    std::vector<QueuePtr> qs;
+    for(size_t q = 0; q < ds._queues; ++q)
+        qs.push_back(std::make_shared<Queue>(DataSet::queue_name(q), QueueId(q)));
+
+    std::vector<std::string> data;
+    for(size_t pos = 0; pos < ds._tail; ++pos)
+        data.push_back(ds.record(pos));
+
+    Probe start;
+    for(size_t pos = 0; pos < ds._tail; ++pos)
+        for(auto& q : qs)
+            q->push(data[pos]);
+    Probe finish;
+
+    b.report("push." + ds.name(), start, finish, ds._tail * ds._queues);
+}
+
+void bench_at(Bench& b, const DataSet& ds)
+{
+    TempDir td;
+    ds.write();
+
+    Queues qs;
+    {
+        Silence s;
+        qs.load();
+    }
+
+    size_t ops = 0;
+    size_t bytes = 0;
+
+    std::vector<QueuePtr> queues = queues;
+
+    // tail records are always resident
+    Probe tail_start;
+    for(auto& q : queues)
+        for(auto& r : q->_tail.records())
+            bytes += q->at(r._pos)._data.size();
+    Probe tail_finish;
+    for(auto& q : queues)
+        ops += q->_tail.size();
+    if(ds._tail > 0)
+        b.report("at.tail." + ds.name(), tail_start, tail_finish, ops);
+
+    // every consumer after the first one reuses the encoded record
+    const size_t consumers = 8;
+    Probe wire_start;
+    for(size_t c = 0; c < consumers; ++c)
+        for(auto& q : queues)
+            for(auto& r : q->_tail.records())
+                bytes += q->wire(r._pos)._wire.size();
+    Probe wire_finish;
+    if(ds._tail > 0)
+        b.report("wire.tail.c" + std::to_string(consumers) + "." + ds.name(), wire_start, wire_finish, ops * consumers);
+
+    if(ds._blocks == 0)
+        return;
+
+    // blocks are cold, so the sequential sweep pays for RecordsBlock::load
+    // on every block boundary
+    for(auto& q : queues)
+        for(auto& rb : q->_blocks)
+            rb.unload();
+
+    ops = 0;
+    Probe block_start;
+    for(auto& q : queues)
+        for(size_t pos = q->first(); pos < ds._blocks * ds._block_size; ++pos, ++ops)
+            bytes += q->at(pos)._data.size();
+    Probe block_finish;
+    b.report("at.block." + ds.name(), block_start, block_finish, ops);
+
+    if(bytes == 0)
+        std::cerr << "no data read" << std::endl;
+}
+
+void bench_block_load(Bench& b, const DataSet& ds)
+{
+    if(ds._blocks == 0)
+        return;
+
+    TempDir td;
+    ds.write();
+
+    RecordsBlocks rbs;
+    for(auto itp = boost::filesystem::directory_iterator(QUEUES_DIR); itp != boost::filesystem::directory_iterator(); itp++) {
+        std::string filename = itp->path().filename().string();
+        boost::cmatch groups;
+        if(boost::regex_match(filename.c_str(), groups, RB_FILE_NAME_PATTERN) && groups[2] != groups[3])
+            rbs.emplace_back(itp->path(), groups);
+    }
+
+    Probe start;
+    for(auto& rb : rbs) {
+        rb.load();
+        rb.unload();
+    }
+    Probe finish;
+
+    b.report("block.load." + ds.name(), start, finish, rbs.size());
+}
+
+void bench_queues_load(Bench& b, const DataSet& ds)
+{
+    TempDir td;
+    ds.write();
+
+    Queues qs;
+    Probe start;
+    {
+        Silence s;
+        qs.load();
+    }
+    Probe finish;
+
+    // one op is one record found on disk
+    b.report("queues.load." + ds.name(), start, finish, ds._queues * (ds._blocks * ds._block_size + ds._tail));
+}
+
+int main()
+{
+    try {
+        std::cout << "rq_bench build " << build_version() << std::endl;
+
+        Bench b;
+
+        std::vector<DataSet> push_sets = {
+            {1, 0, 0, 1000, 16},
+            {1, 0, 0, 1000, 1024},
+            {16, 0, 0, 100, 16},
+            {256, 0, 0, 10, 16},
+        };
+        for(auto& ds : push_sets)
+            bench_push(b, ds);
+
+        std::vector<DataSet> load_sets = {
+            {1, 10, 100, 100, 16},
+            {1, 10, 1000, 100, 16},
+            {1, 2, 10000, 0, 16},
+            {1, 10, 1000, 0, 1024},
+            {16, 4, 1000, 10, 16},
+            {256, 1, 100, 10, 16},
+        };
+        for(auto& ds : load_sets) {
+            bench_block_load(b, ds);
+            bench_at(b, ds);
+            bench_queues_load(b, ds);
+        }
+
+    } catch(std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,41 +1,90 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
 #include <fstream>
 
 #include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 
 #include "metrics.h"
 #include "queue.h"
+#include "loops.h"
+#include "storage.h"
+#include "subscription.h"
+#include "backpressure.h"
+
+// sessions serve TCP and unix domain connections alike
+using Socket = boost::asio::generic::stream_protocol::socket;
 
 bool is_num(const std::string& s)
 {
     if(s.empty())
         return false;
     for(auto c : s)
-        if(!std::isdigit(c))
+        if(!std::isdigit(static_cast<unsigned char>(c)))
             return false;
     return true;
 }
 
+// is_num that also fits into 64 bits
+bool parse_num(const std::string& s, uint64_t& value)
+{
+    if(!is_num(s))
+        return false;
+    errno = 0;
+    value = std::strtoull(s.c_str(), nullptr, 10);
+    return errno != ERANGE;
+}
+
+// resident bytes, on-disk bytes, files, pushes and pops in the last second;
+// on the owner loop of q, reads running totals only
+std::string accounting(Queue& q)
+{
+    uint64_t now = now_ms();
+    return
+        '\t' + std::to_string(q.resident()) +
+        '\t' + std::to_string(q.disk_bytes()) +
+        '\t' + std::to_string(q.files()) +
+        '\t' + std::to_string(q._pushes.per_second(now)) +
+        '\t' + std::to_string(q._pops.per_second(now));
+}
 
 struct CommandState {
     Metrics& _m;
     Queues& _qs;
+    Storage& _st;
+    Loops& _loops;
+    Subscribers& _subs;
     QueuePtr _q;
     size_t _p;
+    SubscriberPtr _sub;
+    ReadAhead _ahead;
+    bool _busy;
 
-    boost::asio::ip::tcp::socket& _socket;
+    Outbound<Socket>& _out;
     boost::asio::io_service::strand& _strand;
 
     CommandState(
         Metrics& m,
         Queues& qs,
-        boost::asio::ip::tcp::socket& socket,
+        Storage& st,
+        Loops& loops,
+        Subscribers& subs,
+        Outbound<Socket>& out,
         boost::asio::io_service::strand& strand
-    ) : _m(m), _qs(qs), _q(nullptr), _p(0), _socket(socket), _strand(strand)
+    ) : _m(m), _qs(qs), _st(st), _loops(loops), _subs(subs), _q(nullptr), _p(0), _sub(nullptr), _busy(false), _out(out), _strand(strand)
     {
     }
+
+    // queue state is touched on the loop owning the queue
+    template<typename Op>
+    void own(const Queue& q, Op op, boost::asio::yield_context& yield)
+    {
+        _loops.own(q, op, _strand, yield);
+    }
 };
 
 class Command
@@ -65,17 +114,18 @@ public:
     virtual std::string validate(std::vector<std::string>& tokens) final
     {
         std::string response;
+        uint64_t value = 0;
         if(tokens.size() < 2)
             response = "ERR not enough argument";
-        else if(tokens.size() > 2 && !is_num(tokens[2])) {
+        else if(tokens.size() > 2 && !parse_num(tokens[2][0] == '@' ? tokens[2].substr(1) : tokens[2], value)) {
             boost::to_upper(tokens[2]);
             if(tokens[2] != "NEW" && tokens[2] != "LAST" && tokens[2] != "FIRST")
-                response = "ERR queue pos must have positive integer, 'NEW', LAST' or 'FIRST' value";
+                response = "ERR queue pos must have positive integer, '@unix_ms', 'NEW', LAST' or 'FIRST' value";
         }
 
         if(response.empty())
             for(auto c: tokens[1])
-                if(!(std::isalnum(c) or c == '_')) {
+                if(!(std::isalnum(static_cast<unsigned char>(c)) or c == '_')) {
                     response = "ERR invalid queue name";
                     break;
                 }
@@ -89,16 +139,29 @@ public:
 
         _s._q = _s._qs.queue(tokens[1]);
 
-        if(_s._q->empty())
-            _s._p = 0;
-        else if(tokens.size() <= 2 || tokens[2] == "FIRST")
-            _s._p = _s._q->first();
-        else if(tokens[2] == "LAST")
-            _s._p = _s._q->last();
-        else if(tokens[2] == "NEW")
-            _s._p = _s._q->last() + 1;
-        else
-            _s._p = std::stoul(tokens[2]);
+        // validate() made sure a number fits
+        uint64_t value = 0;
+        bool at = tokens.size() > 2 && tokens[2][0] == '@';
+        if(tokens.size() > 2)
+            parse_num(at ? tokens[2].substr(1) : tokens[2], value);
+
+        QueuePtr q = _s._q;
+        size_t p = 0;
+        _s.own(*q, [&]() {
+            if(q->empty())
+                p = 0;
+            else if(tokens.size() <= 2 || tokens[2] == "FIRST")
+                p = q->first();
+            else if(tokens[2] == "LAST")
+                p = q->last();
+            else if(tokens[2] == "NEW")
+                p = q->last() + 1;
+            else if(at)
+                p = q->seek(value);
+            else
+                p = value;
+        }, yield);
+        _s._p = p;
 
         return std::move(response);
     }
@@ -127,15 +190,18 @@ public:
         _s._m.update("session.successes." + name(), 1);
 
         boost::system::error_code ec;
-        for(auto& q : _s._qs._qm) {
-            std::string qi = q.second->_name + '\t';
-            if(!q.second->empty())
-                qi += std::to_string(q.second->first()) + '\t' + std::to_string(q.second->last());
-            else
-                qi += "\t";
+        for(auto& q : _s._qs.list()) {
+            std::string qi = q->_name + '\t';
+            _s.own(*q, [&]() {
+                if(!q->empty())
+                    qi += std::to_string(q->first()) + '\t' + std::to_string(q->last());
+                else
+                    qi += "\t";
+                qi += accounting(*q);
+            }, yield);
             qi += '\n';
 
-            boost::asio::async_write(_s._socket, boost::asio::buffer(qi.c_str(), qi.length()), yield[ec]);
+            _s._out.write(std::move(qi), yield, ec);
             if(ec) {
                 response = "ERR session error";
                 std::cerr << "session error: " << ec << std::endl;
@@ -171,15 +237,20 @@ public:
         std::string response;
         _s._m.update("session.successes." + name(), 1);
 
-        std::string qi = _s._q->_name + '\t';
-        if(!_s._q->empty())
-            qi += std::to_string(_s._q->first()) + '\t' + std::to_string(_s._q->last()) + '\t' + std::to_string(_s._p);
-        else
-            qi += "\t\t";
+        QueuePtr q = _s._q;
+        size_t p = _s._p;
+        std::string qi = q->_name + '\t';
+        _s.own(*q, [&]() {
+            if(!q->empty())
+                qi += std::to_string(q->first()) + '\t' + std::to_string(q->last()) + '\t' + std::to_string(p);
+            else
+                qi += "\t\t";
+            qi += accounting(*q);
+        }, yield);
         qi += '\n';
 
         boost::system::error_code ec;
-        boost::asio::async_write(_s._socket, boost::asio::buffer(qi.c_str(), qi.length()), yield[ec]);
+        _s._out.write(std::move(qi), yield, ec);
         if(ec) {
             response = "ERR session error";
             std::cerr << "session error: " << ec << std::endl;
@@ -213,14 +284,13 @@ public:
         std::string response;
         _s._m.update("session.successes." + name(), 1);
 
-        boost::system::error_code ec;
         for(size_t n = 1; n < tokens.size(); ++n) {
-            _s._q->push(tokens[n]);
-
-            _s._strand.post(yield[ec]);
-            if(ec) {
-                response = "ERR session error";
-                std::cerr << "session error: " << ec << std::endl;
+            try {
+                size_t pos = _s._st.push(*_s._q, tokens[n], _s._strand, yield);
+                _s._subs.notify(_s._q, pos);
+            } catch(std::exception& e) {
+                response = "ERR storage error";
+                std::cerr << "storage error: " << e.what() << std::endl;
                 break;
             }
         }
@@ -253,19 +323,29 @@ public:
         std::string response;
         _s._m.update("session.successes." + name(), 1);
 
-        if(_s._q->empty())
-            response = "ERR queue empty";
-        else if(_s._p > _s._q->last())
-            response = "ERR no new data";
-        else if(_s._p < _s._q->first())
-            response = "ERR data lost in cursor position";
-        else {
-            const Record& r = _s._q->at(_s._p);
-            std::string data = std::to_string(r._pos) + '\t' + r._data + '\n';
+        QueuePtr q = _s._q;
+        size_t p = _s._p;
+        _s.own(*q, [&]() {
+            if(q->empty())
+                response = "ERR queue empty";
+            else if(p > q->last())
+                response = "ERR no new data";
+            else if(p < q->first())
+                response = "ERR data lost in cursor position";
+        }, yield);
+
+        if(response.empty()) {
+            Encoded data;
+            try {
+                data = _s._st.wire(*q, p, _s._ahead, _s._strand, yield);
+            } catch(std::exception& e) {
+                std::cerr << "storage error: " << e.what() << std::endl;
+                return "ERR storage error";
+            }
             ++_s._p;
 
             boost::system::error_code ec;
-            boost::asio::async_write(_s._socket, boost::asio::buffer(data.c_str(), data.length()), yield[ec]);
+            _s._out.write(std::move(data), yield, ec);
             if(ec) {
                 response = "ERR session error";
                 std::cerr << "session error: " << ec << std::endl;
@@ -299,30 +379,44 @@ public:
         _s._m.update("session.successes." + name(), 1);
 
         boost::system::error_code ec;
+        ReadAhead ahead;
         bool first = true;
-        for(auto& q : _s._qs._qm) {
+        for(auto& q : _s._qs.list()) {
             std::string qi;
             if(!first)
                 qi += '\n';
             else
                 first = false;
-            qi += q.second->_name + '\t';
-            if(!q.second->empty())
-                qi += std::to_string(q.second->first()) + '\t' + std::to_string(q.second->last());
+            qi += q->_name + '\t';
+            bool empty = true;
+            size_t first = 0, last = 0;
+            _s.own(*q, [&]() {
+                empty = q->empty();
+                first = q->first();
+                last = q->last();
+            }, yield);
+            if(!empty)
+                qi += std::to_string(first) + '\t' + std::to_string(last);
             else
                 qi += "\t";
             qi += '\n';
 
-            boost::asio::async_write(_s._socket, boost::asio::buffer(qi.c_str(), qi.length()), yield[ec]);
+            _s._out.write(std::move(qi), yield, ec);
             if(ec)
                 break;
 
-            if(!q.second->empty())
-                for(size_t n = q.second->first(); n <= q.second->last(); ++n) {
-                    const Record& r = q.second->at(n);
-                    std::string data = std::to_string(r._pos) + '\t' + r._data + '\n';
-                    std::cerr << '\t' << data;
-                    boost::asio::async_write(_s._socket, boost::asio::buffer(data.c_str(), data.length()), yield[ec]);
+            if(!empty)
+                for(size_t n = first; n <= last; ++n) {
+                    Encoded data;
+                    try {
+                        data = _s._st.wire(*q, n, ahead, _s._strand, yield);
+                    } catch(std::exception& e) {
+                        std::cerr << "storage error: " << e.what() << std::endl;
+                        return "ERR storage error";
+                    }
+
+                    std::cerr << '\t' << data._wire;
+                    _s._out.write(std::move(data), yield, ec);
                     if(ec)
                         break;
                 }
@@ -331,7 +425,7 @@ public:
                 break;
         }
         if(!ec)
-            boost::asio::async_write(_s._socket, boost::asio::buffer("\n", 1), yield[ec]);
+            _s._out.write("\n", yield, ec);
 
         if(ec) {
             response = "ERR session error";
@@ -342,6 +436,124 @@ public:
     }
 };
 
+class CSubscribe : public Command
+{
+private:
+    CommandState& _s;
+
+public:
+    CSubscribe(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final
+    {
+        return "SUBSCRIBE";
+    }
+    virtual std::string validate(std::vector<std::string>& tokens) final
+    {
+        std::string response;
+        if(tokens.size() < 2)
+            response = "ERR not enough argument";
+
+        for(size_t n = 1; n < tokens.size() && response.empty(); ++n)
+            for(auto c: tokens[n])
+                if(!(std::isalnum(static_cast<unsigned char>(c)) or c == '_' or c == '*' or c == '?')) {
+                    response = "ERR invalid queue name or glob";
+                    break;
+                }
+
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final
+    {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+
+        if(_s._sub == nullptr)
+            _s._sub = std::make_shared<Subscriber>(_s._strand);
+
+        for(size_t n = 1; n < tokens.size(); ++n)
+            if(is_glob(tokens[n])) {
+                _s._subs.watch(_s._sub, tokens[n]);
+                for(auto& q : _s._qs.list())
+                    if(glob_match(tokens[n], q->_name))
+                        _s._subs.follow(_s._sub, q, q->_published);
+            } else {
+                QueuePtr q = _s._qs.queue(tokens[n]);
+                _s._subs.follow(_s._sub, q, q->_published);
+            }
+
+        return std::move(response);
+    }
+};
+
+class CCredit : public Command
+{
+private:
+    CommandState& _s;
+
+public:
+    CCredit(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final
+    {
+        return "CREDIT";
+    }
+    virtual std::string validate(std::vector<std::string>& tokens) final
+    {
+        std::string response;
+        uint64_t n = 0;
+        if(_s._sub == nullptr)
+            response = "ERR not subscribed";
+        else if(tokens.size() != 2 || !parse_num(tokens[1], n))
+            response = "ERR credit must have positive integer value";
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final
+    {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+
+        uint64_t n = 0;
+        parse_num(tokens[1], n);
+        _s._sub->credit(n);
+        _s._sub->_wake.notify();
+
+        return std::move(response);
+    }
+};
+
+class CUnsubscribe : public Command
+{
+private:
+    CommandState& _s;
+
+public:
+    CUnsubscribe(CommandState& s) : _s(s) {}
+
+    virtual std::string name() final
+    {
+        return "UNSUBSCRIBE";
+    }
+    virtual std::string validate(std::vector<std::string>& tokens) final
+    {
+        std::string response;
+        if(_s._sub == nullptr)
+            response = "ERR not subscribed";
+        return std::move(response);
+    }
+    virtual std::string execute(std::vector<std::string>& tokens, boost::asio::yield_context& yield) final
+    {
+        std::string response;
+        _s._m.update("session.successes." + name(), 1);
+
+        _s._sub->_active = false;
+        _s._sub->_wake.notify();
+        _s._sub = nullptr;
+
+        return std::move(response);
+    }
+};
+
 class CHelp : public Command
 {
 private:
@@ -365,16 +577,19 @@ public:
         _s._m.update("session.successes." + name(), 1);
 
         std::vector<std::string> helps;
-        helps.push_back("USE queue_name [pos] - switch to named queue and set specified position to continue after, pos may be number, 'FIRST', 'LAST' or 'NEW'\n");
-        helps.push_back("LIST - respond with names, sizes, 1st and last positions of queues\n");
-        helps.push_back("QUEUE - respond with current queue and first, last, current positions\n");
+        helps.push_back("USE queue_name [pos] - switch to named queue and set specified position to continue after, pos may be number, '@unix_ms' for the first record pushed at or after that time, 'FIRST', 'LAST' or 'NEW'\n");
+        helps.push_back("LIST - respond with names, 1st and last positions of queues, then resident bytes, bytes on disk, files, pushes and pops in the last second\n");
+        helps.push_back("QUEUE - respond with current queue and first, last, current positions, then the same accounting as LIST\n");
         helps.push_back("PUSH data - add data after last record. do not move cursor\n");
         helps.push_back("POP - respond with data at cursor position. move cursor forward. error if it was last position.\n");
+        helps.push_back("SUBSCRIBE name_or_glob ... - stream records pushed from now on to named queues or queues matching '*' and '?' globs as 'MSG queue pos data'\n");
+        helps.push_back("CREDIT n - allow n more streamed records, a subscription starts with " + std::to_string(SUBSCRIBE_DEFAULT_CREDIT) + "\n");
+        helps.push_back("UNSUBSCRIBE - stop streaming\n");
         helps.push_back("HELP print this text\n");
 
         boost::system::error_code ec;
         for(auto& h : helps) {
-            boost::asio::async_write(_s._socket, boost::asio::buffer(h.c_str(), h.length()), yield[ec]);
+            _s._out.write(h, yield, ec);
             if(ec) {
                 response = "ERR session error";
                 std::cerr << "session error: " << ec << std::endl;
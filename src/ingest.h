@@ -0,0 +1,147 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include "metrics.h"
+#include "queue.h"
+#include "storage.h"
+#include "subscription.h"
+#include "ring.h"
+
+// how long the drain sleeps on an idle ring before it looks at stop()
+const std::chrono::milliseconds INGEST_IDLE_TIMEOUT(100);
+// records taken from the ring and not stored yet
+const size_t INGEST_MAX_INFLIGHT = 256;
+
+// Takes PUSH requests that local producers put into a shared memory ring
+// and stores them as a session would, subscribers get notified as usual.
+// A thread of its own drains the ring and sleeps on its doorbell when the
+// ring runs dry. Every record is stored by a coroutine of its own, so writes
+// to different queues run in the storage pool side by side; the records of
+// one queue still take positions in ring order, see Storage::push.
+class Ingest
+{
+private:
+    Metrics& _m;
+    Queues& _qs;
+    Storage& _st;
+    Subscribers& _subs;
+
+    ShmRing _shm;
+    boost::asio::io_service::strand _strand;
+    std::unique_ptr<boost::asio::io_service::work> _work;
+    std::thread _thread;
+    std::atomic<bool> _running;
+
+    std::mutex _lock;
+    std::condition_variable _done;
+    size_t _inflight;
+
+    static bool valid(const std::string& name, const std::string& data)
+    {
+        return
+            !name.empty() &&
+            std::all_of(name.begin(), name.end(), [](char c) {
+                return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+            }) &&
+            data.find('\n') == std::string::npos;
+    }
+
+    // on the drain thread, the coroutine takes its position before it first yields
+    void store(std::string name, std::string data)
+    {
+        boost::asio::spawn(_strand,
+        [this, name = std::move(name), data = std::move(data)](boost::asio::yield_context yield) {
+            if(!valid(name, data))
+                _m.update("ingest.errors.invalid", 1);
+            else {
+                QueuePtr q = _qs.queue(name);
+                try {
+                    size_t pos = _st.push(*q, data, _strand, yield);
+                    _subs.notify(q, pos);
+                    _m.update("ingest.records", 1);
+                } catch(std::exception& e) {
+                    _m.update("ingest.errors.storage", 1);
+                    std::cerr << "storage error: " << e.what() << std::endl;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                --_inflight;
+            }
+            _done.notify_one();
+        });
+    }
+
+    void drain()
+    {
+        Ring ring = _shm.ring();
+        std::string name;
+        std::string data;
+        while(_running) {
+            if(!ring.pop(name, data)) {
+                ring.wait(INGEST_IDLE_TIMEOUT);
+                continue;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+                _done.wait(lock, [this]() {
+                    return _inflight < INGEST_MAX_INFLIGHT;
+                });
+                ++_inflight;
+            }
+            store(std::move(name), std::move(data));
+        }
+
+        // the loop runs on until the records in flight are stored
+        _work.reset();
+    }
+
+public:
+    Ingest(boost::asio::io_service& io, const std::string& name, Queues& qs, Storage& st, Subscribers& subs, Metrics& m) :
+        _m(m),
+        _qs(qs),
+        _st(st),
+        _subs(subs),
+        _shm(name, RING_DEFAULT_SLOTS, RING_DEFAULT_SLOT_SIZE),
+        _strand(io),
+        _running(true),
+        _inflight(0)
+    {}
+
+    Ingest(const Ingest&) = delete;
+    Ingest& operator=(const Ingest&) = delete;
+
+    ~Ingest()
+    {
+        stop();
+        if(_thread.joinable())
+            _thread.join();
+    }
+
+    void go()
+    {
+        _work = std::make_unique<boost::asio::io_service::work>(_strand.get_io_service());
+        _thread = std::thread([this]() {
+            drain();
+        });
+    }
+
+    void stop()
+    {
+        _running = false;
+        _shm.ring().notify();
+    }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <exception>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include "queue.h"
+
+// Run op through executor (an io_service or a strand) and suspend the
+// coroutine running on strand until it is done. Exceptions thrown by op
+// are rethrown to the coroutine.
+template<typename Executor, typename Op>
+void hop(Executor& executor, Op op, boost::asio::io_service::strand& strand, boost::asio::yield_context& yield)
+{
+    boost::asio::deadline_timer done(strand.get_io_service(), boost::posix_time::ptime(boost::posix_time::pos_infin));
+    std::exception_ptr error;
+
+    executor.post([&]() {
+        try {
+            op();
+        } catch(...) {
+            error = std::current_exception();
+        }
+        strand.post([&]() {
+            done.cancel();
+        });
+    });
+
+    boost::system::error_code ec;
+    done.async_wait(yield[ec]);
+
+    if(error)
+        std::rethrow_exception(error);
+}
+
+// Event loops, one thread each. Every queue is owned by one loop and its
+// in-memory state is touched on that loop's thread only. Sessions stay on
+// the loop that accepted them and hand queue work over to the owner.
+class Loops
+{
+private:
+    std::vector<std::unique_ptr<boost::asio::io_service>> _ios;
+
+public:
+    explicit Loops(size_t count)
+    {
+        for(size_t n = 0; n < count; ++n)
+            _ios.push_back(std::make_unique<boost::asio::io_service>());
+    }
+
+    size_t size() const
+    {
+        return _ios.size();
+    }
+
+    boost::asio::io_service& at(size_t n)
+    {
+        return *_ios[n];
+    }
+
+    boost::asio::io_service& owner(const Queue& q)
+    {
+        return *_ios[q._id % _ios.size()];
+    }
+
+    // run op on the owner of q, inline when the coroutine already is there
+    template<typename Op>
+    void own(const Queue& q, Op op, boost::asio::io_service::strand& strand, boost::asio::yield_context& yield)
+    {
+        boost::asio::io_service& io = owner(q);
+        if(&io == &strand.get_io_service())
+            op();
+        else
+            hop(io, op, strand, yield);
+    }
+};
@@ -35,6 +35,11 @@ public:
         _update(metric, increment);
     }
 
+    const metrics_t& metrics() const
+    {
+        return _metrics;
+    }
+
     void dump(const std::string& prefix = "", std::ostream& out = std::cout)
     {
         for(auto &m : _metrics) {
@@ -3,25 +3,297 @@
 #include <list>
 #include <deque>
 #include <map>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
 #include <tuple>
 #include <fstream>
 #include <string>
-
+#include <vector>
+#include <ctime>
+#include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
 #include <boost/regex.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_ref.hpp>
 
 const size_t RECORDS_BLOCK_MAX_SIZE = 10000;
+const size_t RECORDS_TAIL_CHUNK_SIZE = 64 * 1024;
 const boost::filesystem::path QUEUES_DIR = ".";
+using QueueId = uint32_t;
+
 const boost::regex RB_FILE_NAME_PATTERN = boost::regex("([^\\.]+)\\.(\\d+)\\.(\\d+)\\.rec(.tmp)?");
+const boost::regex IDX_FILE_NAME_PATTERN = boost::regex("([^\\.]+)\\.(\\d+)\\.(\\d+)\\.idx(.tmp)?");
+
+// Completes a file written through out, so it may be renamed into place.
+// Throws when any part of it did not reach the file.
+inline void finish_file(std::ofstream& out, const boost::filesystem::path& path)
+{
+    out.flush();
+    if(!out)
+        throw std::runtime_error("Can't write " + path.string());
+    out.close();
+    if(out.fail())
+        throw std::runtime_error("Can't close " + path.string());
+}
+
+// Flushes a file or a directory to the disk; a directory keeps the renames
+// and removals made in it.
+inline void sync_path(const boost::filesystem::path& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Can't open " + path.string() + " to sync");
+    int rc = ::fsync(fd);
+    ::close(fd);
+    if(rc != 0)
+        throw std::runtime_error("Can't sync " + path.string());
+}
+
+// unix time in milliseconds, 0 stands for unknown append time
+inline uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
 struct Record {
     size_t _pos;
     std::string _data;
+    uint64_t _time;
 
     Record() = delete;
     Record(Record&&) = default;
-    Record(size_t pos, const std::string& data) : _pos(pos), _data(data) {}
+    Record(size_t pos, const std::string& data, uint64_t time = 0) : _pos(pos), _data(data), _time(time) {}
+};
+
+// what readers get from Queue::at, valid until the record is sealed or its block unloaded
+struct RecordView {
+    size_t _pos;
+    boost::string_ref _data;
+    uint64_t _time;
+};
+
+// first position appended at a given millisecond, one per distinct append time
+struct TimePoint {
+    size_t _pos;
+    uint64_t _time;
+};
+
+using TimeIndex = std::vector<TimePoint>;
+
+// A record as POP and DUMP send it, "pos\tdata\n" inside memory every reader
+// shares: a tail chunk or a loaded block. Handing it out allocates nothing.
+struct Encoded {
+    std::shared_ptr<const void> _owner;
+    boost::string_ref _wire;
+
+    bool empty() const
+    {
+        return _owner == nullptr;
+    }
+};
+
+inline Encoded encode(std::string wire)
+{
+    auto owner = std::make_shared<const std::string>(std::move(wire));
+    return Encoded{owner, boost::string_ref(*owner)};
+}
+
+// length of "pos\t" in front of the data of an encoded record
+inline size_t pos_prefix(size_t pos)
+{
+    size_t size = 2;
+    while(pos >= 10) {
+        pos /= 10;
+        ++size;
+    }
+    return size;
+}
+
+// events in the last whole second, reading as 0 once a second passes without any
+class Rate
+{
+private:
+    uint64_t _second;
+    size_t _current;
+    size_t _previous;
+
+    void roll(uint64_t ms)
+    {
+        uint64_t second = ms / 1000;
+        if(second == _second)
+            return;
+        _previous = second == _second + 1 ? _current : 0;
+        _current = 0;
+        _second = second;
+    }
+
+public:
+    Rate() : _second(0), _current(0), _previous(0) {}
+
+    void add(uint64_t ms)
+    {
+        roll(ms);
+        ++_current;
+    }
+
+    size_t per_second(uint64_t ms)
+    {
+        roll(ms);
+        return _previous;
+    }
+};
+
+// size of a single record file as Queue::write makes it
+inline size_t record_file_size(boost::string_ref data, uint64_t time)
+{
+    return data.size() + std::to_string(time).size() + 2;
+}
+
+inline void index_time(TimeIndex& times, size_t pos, uint64_t time)
+{
+    if(times.empty() || times.back()._time < time)
+        times.push_back(TimePoint{pos, time});
+}
+
+// Append-only storage of the unsealed queue tail. Payloads are packed into
+// large chunks instead of one heap string per record, a chunk is freed as a
+// whole once every record in it has been released.
+class RecordsTail
+{
+private:
+    struct Chunk {
+        std::shared_ptr<char> _data;
+        size_t _size;
+        size_t _used;
+        size_t _last;
+    };
+
+    std::deque<Chunk> _chunks;
+    std::deque<RecordView> _records;
+
+    // running totals of the chunks and of the single record files
+    size_t _resident = 0;
+    size_t _disk_bytes = 0;
+
+    const Chunk& chunk(size_t pos) const
+    {
+        return *std::lower_bound(_chunks.begin(), _chunks.end(), pos, [](auto& c, size_t pos) {
+            return c._last < pos;
+        });
+    }
+
+public:
+    bool empty() const
+    {
+        return _records.empty();
+    }
+
+    size_t size() const
+    {
+        return _records.size();
+    }
+
+    size_t first() const
+    {
+        return _records.front()._pos;
+    }
+
+    size_t last() const
+    {
+        return _records.back()._pos;
+    }
+
+    bool contains(size_t pos) const
+    {
+        return !empty() && first() <= pos && last() >= pos;
+    }
+
+    const RecordView& at(size_t pos) const
+    {
+        return _records[pos - first()];
+    }
+
+    // records are stored encoded, the data view sits right after "pos\t"
+    Encoded wire(size_t pos) const
+    {
+        const RecordView& r = at(pos);
+        size_t prefix = pos_prefix(pos);
+        return Encoded{chunk(pos)._data, boost::string_ref(r._data.data() - prefix, prefix + r._data.size() + 1)};
+    }
+
+    const std::deque<RecordView>& records() const
+    {
+        return _records;
+    }
+
+    size_t resident() const
+    {
+        return _resident;
+    }
+
+    size_t disk_bytes() const
+    {
+        return _disk_bytes;
+    }
+
+    void append(size_t pos, boost::string_ref data, uint64_t time)
+    {
+        size_t prefix = pos_prefix(pos);
+        size_t size = prefix + data.size() + 1;
+        if(_chunks.empty() || _chunks.back()._size - _chunks.back()._used < size) {
+            size_t chunk_size = std::max(size, RECORDS_TAIL_CHUNK_SIZE);
+            _chunks.push_back(Chunk{std::shared_ptr<char>(new char[chunk_size], std::default_delete<char[]>()), chunk_size, 0, pos});
+            _resident += chunk_size;
+        }
+
+        Chunk& c = _chunks.back();
+        char* p = c._data.get() + c._used;
+        std::snprintf(p, prefix + 1, "%zu\t", pos);
+        std::memcpy(p + prefix, data.data(), data.size());
+        p[size - 1] = '\n';
+        c._used += size;
+        c._last = pos;
+
+        _records.push_back(RecordView{pos, boost::string_ref(p + prefix, data.size()), time});
+        _disk_bytes += record_file_size(data, time);
+    }
+
+    // forget records up to pos inclusive, readers still sending keep their chunk alive
+    void release(size_t pos)
+    {
+        while(!_records.empty() && _records.front()._pos <= pos) {
+            _disk_bytes -= record_file_size(_records.front()._data, _records.front()._time);
+            _records.pop_front();
+        }
+        while(!_chunks.empty() && _chunks.front()._last <= pos) {
+            _resident -= _chunks.front()._size;
+            _chunks.pop_front();
+        }
+    }
+};
+
+// A loaded block: records encoded as "pos\tdata\n" back to back in one buffer
+// and where every record line starts, plus the end of the last one.
+struct BlockPayload {
+    std::shared_ptr<const std::string> _wire;
+    std::vector<size_t> _starts;
+    // append time of a single record file, blocks keep theirs in the index
+    uint64_t _time = 0;
 };
 
 struct RecordsBlock {
@@ -30,9 +302,20 @@ struct RecordsBlock {
     size_t _first;
     size_t _last;
     bool _tmp;
-    std::vector<Record> _records;
+    BlockPayload _payload;
+    TimeIndex _times;
     std::time_t _last_access_time;
 
+    // read ahead state, see Storage::prefetch; readers waiting for a
+    // prefetch in flight are called back on the owner loop when it is done
+    bool _prefetching;
+    bool _prefetched;
+    std::vector<std::function<void()>> _waiters;
+
+    // block and time index files
+    size_t _disk_bytes;
+    size_t _files;
+
     RecordsBlock() = delete;
     RecordsBlock(const boost::filesystem::path& path, const boost::cmatch& groups) noexcept :
         _path(path),
@@ -40,56 +323,212 @@ struct RecordsBlock {
         _first(std::stoul(groups[2])),
         _last(std::stoul(groups[3])),
         _tmp(groups[4] == ".tmp"),
-        _last_access_time(std::time(nullptr))
+        _last_access_time(std::time(nullptr)),
+        _prefetching(false),
+        _prefetched(false),
+        _disk_bytes(0),
+        _files(0)
+    {}
+    RecordsBlock(const std::string& name, size_t first, size_t last) noexcept :
+        _path(path(name, first, last)),
+        _name(name),
+        _first(first),
+        _last(last),
+        _tmp(false),
+        _last_access_time(std::time(nullptr)),
+        _prefetching(false),
+        _prefetched(false),
+        _disk_bytes(0),
+        _files(0)
     {}
     RecordsBlock(RecordsBlock&&) = default;
     RecordsBlock& operator=(RecordsBlock&&) = default;
 
-    void load()
+    static boost::filesystem::path path(const std::string& name, size_t first, size_t last)
     {
-        std::time(&_last_access_time);
+        return QUEUES_DIR / (name + "." + std::to_string(first) + "." + std::to_string(last) + ".rec");
+    }
 
-        if(!_records.empty())
-            return;
+    static boost::filesystem::path times_path(const std::string& name, size_t first, size_t last)
+    {
+        return QUEUES_DIR / (name + "." + std::to_string(first) + "." + std::to_string(last) + ".idx");
+    }
+
+    static void write_times(const boost::filesystem::path& path, const TimeIndex& times)
+    {
+        boost::filesystem::path tmp = path.string() + ".tmp";
+
+        std::ofstream out(tmp.c_str());
+        for(auto& t : times)
+            out << t._pos << '\t' << t._time << '\n';
+        finish_file(out, tmp);
+        sync_path(tmp);
+
+        if(std::rename(tmp.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("Can't rename time index tmp file name");
+    }
 
-        _records.reserve(_last - _first + 1);
+    static size_t disk_bytes(const std::string& name, size_t first, size_t last)
+    {
+        boost::system::error_code ec;
+        size_t size = 0;
+        for(auto& p : {path(name, first, last), times_path(name, first, last)}) {
+            uintmax_t s = boost::filesystem::file_size(p, ec);
+            if(!ec)
+                size += s;
+        }
+        return size;
+    }
+
+    void stat()
+    {
+        _disk_bytes = disk_bytes(_name, _first, _last);
+        _files = boost::filesystem::exists(times_path(_name, _first, _last)) ? 2 : 1;
+    }
+
+    // blocks sealed before time indexing existed have no index and never match a seek
+    void read_times()
+    {
+        std::ifstream in(times_path(_name, _first, _last).string());
+        size_t pos;
+        uint64_t time;
+        while(in >> pos >> time)
+            index_time(_times, pos, time);
+    }
+
+    // touches nothing but the immutable block bounds, so it may run off the event loop thread
+    BlockPayload read() const
+    {
+        size_t count = _last - _first + 1;
+        boost::system::error_code ec;
+        uintmax_t file_size = boost::filesystem::file_size(_path, ec);
+
+        auto wire = std::make_shared<std::string>();
+        wire->reserve((ec ? 0 : file_size) + count * pos_prefix(_last));
+
+        BlockPayload payload{nullptr, {}, 0};
+        payload._starts.reserve(count + 1);
 
         std::ifstream in(_path.string());
         std::string line;
+        char prefix[32];
         size_t pos = _first;
-        while(std::getline(in, line) && pos <= _last)
-            _records.emplace_back(pos++, line);
-
-        _records.shrink_to_fit();
+        while(pos <= _last && std::getline(in, line)) {
+            payload._starts.push_back(wire->size());
+            wire->append(prefix, std::snprintf(prefix, sizeof(prefix), "%zu\t", pos++));
+            *wire += line;
+            *wire += '\n';
+        }
+        payload._starts.push_back(wire->size());
 
         if(_last + 1 != pos)
             throw std::runtime_error(_path.string() + " : Broken RecordsBlock, not enough data");
+
+        // a single record file carries its append time on the line after the data
+        if(_first == _last && std::getline(in, line))
+            payload._time = std::strtoull(line.c_str(), nullptr, 10);
+
+        payload._wire = std::move(wire);
+        return payload;
+    }
+
+    bool loaded() const
+    {
+        return _payload._wire != nullptr;
+    }
+
+    size_t resident() const
+    {
+        if(!loaded())
+            return 0;
+        return _payload._wire->capacity() + _payload._starts.capacity() * sizeof(size_t);
+    }
+
+    void load()
+    {
+        std::time(&_last_access_time);
+
+        if(loaded())
+            return;
+
+        _payload = read();
     }
 
+    RecordView at(size_t pos) const
+    {
+        size_t n = pos - _first;
+        size_t prefix = pos_prefix(pos);
+        const char* line = _payload._wire->data() + _payload._starts[n];
+        size_t size = _payload._starts[n + 1] - _payload._starts[n];
+        return RecordView{pos, boost::string_ref(line + prefix, size - prefix - 1), _payload._time};
+    }
+
+    Encoded wire(size_t pos) const
+    {
+        size_t n = pos - _first;
+        const char* line = _payload._wire->data() + _payload._starts[n];
+        return Encoded{_payload._wire, boost::string_ref(line, _payload._starts[n + 1] - _payload._starts[n])};
+    }
+
+    // readers still sending an encoded record keep the payload alive
     void unload()
     {
-        _records.clear();
-        _records.shrink_to_fit();
+        _payload = BlockPayload{nullptr, {}, 0};
     }
 };
 
+// a block with a time index and the last time in it, see Queue::seek
+struct BlockTime {
+    uint64_t _time;
+    RecordsBlock* _block;
+};
+
 struct Queue {
-    std::deque<Record> _records;
+    RecordsTail _tail;
 
     std::list<RecordsBlock> _blocks;
+    std::vector<BlockTime> _block_times;
     std::string _name;
+    QueueId _id;
+    bool _sealing;
 
-    Queue(const std::string& name) noexcept : _name(name) {}
+    // "MSG\tname\t", shared by every record streamed to subscribers
+    Encoded _msg;
+
+    // next position to write and the last append time, see Storage::push
+    size_t _stored;
+    uint64_t _last_time;
+
+    // next() as seen from threads other than the owner loop
+    std::atomic<size_t> _published;
+
+    // write order strand, owned by the Storage serving the queue; see Storage::order
+    mutable std::atomic<boost::asio::io_service::strand*> _order;
+
+    // records appended and read by POP, DUMP and subscribers
+    Rate _pushes;
+    Rate _pops;
+
+    // running totals of the blocks, block payloads change through
+    // load(), install() and unload() only
+    size_t _blocks_resident;
+    size_t _blocks_disk_bytes;
+    size_t _blocks_files;
+
+    Queue(const std::string& name, QueueId id) :
+        _name(name), _id(id), _sealing(false), _msg(encode("MSG\t" + name + '\t')), _stored(0), _last_time(0), _published(0), _order(nullptr),
+        _blocks_resident(0), _blocks_disk_bytes(0), _blocks_files(0)
+    {}
 
     bool empty() const
     {
-        return _records.empty() && _blocks.empty();
+        return _tail.empty() && _blocks.empty();
     }
 
     size_t last() const
     {
-        if(!_records.empty())
-            return _records.back()._pos;
+        if(!_tail.empty())
+            return _tail.last();
         if(!_blocks.empty())
             return _blocks.back()._last;
         return 0;
@@ -99,67 +538,325 @@ struct Queue {
     {
         if(!_blocks.empty())
             return _blocks.front()._first;
-        if(!_records.empty())
-            return _records.front()._pos;
+        if(!_tail.empty())
+            return _tail.first();
         return 0;
     }
 
-    void push(const std::string& data)
+    size_t next() const
     {
-        size_t pos = empty() ? 0 : last() + 1;
-        std::string stem = _name + "." + std::to_string(pos) + "." + std::to_string(pos);
-        boost::filesystem::path rfn = QUEUES_DIR / (stem + ".rec");
-        boost::filesystem::path rfnt = QUEUES_DIR / (stem + ".rec.tmp");
+        return empty() ? 0 : last() + 1;
+    }
+
+    // writes a single record file, safe to run off the event loop thread
+    static void write(const std::string& name, size_t pos, const std::string& data, uint64_t time)
+    {
+        boost::filesystem::path rfn = RecordsBlock::path(name, pos, pos);
+        boost::filesystem::path rfnt = rfn.string() + ".tmp";
 
         std::ofstream out(rfnt.c_str());
-        out << data << "\n";
-        out.close();
+        out << data << "\n" << time << "\n";
+        finish_file(out, rfnt);
 
         if(std::rename(rfnt.c_str(), rfn.c_str()) != 0)
             throw std::runtime_error("Can't rename record tmp file name");
+    }
+
+    // append times never go back even if the wall clock does
+    uint64_t stamp()
+    {
+        _last_time = std::max(_last_time, now_ms());
+        return _last_time;
+    }
+
+    // makes a record already on disk visible, pos must be next()
+    void append(size_t pos, boost::string_ref data, uint64_t time)
+    {
+        _tail.append(pos, data, time);
+        _published.store(pos + 1, std::memory_order_release);
+        _pushes.add(time);
+    }
+
+    void push(const std::string& data)
+    {
+        size_t pos = next();
+        uint64_t time = stamp();
+        write(_name, pos, data, time);
+        _stored = pos + 1;
+        append(pos, data, time);
+
+        if(full()) {
+            std::vector<RecordView> records = sealable();
+            size_t disk_bytes = write_block(_name, records);
+            seal(records.back()._pos, disk_bytes);
+        }
+    }
 
-        _records.emplace_back(pos, data);
+    bool full() const
+    {
+        return !_sealing && _tail.size() >= RECORDS_BLOCK_MAX_SIZE;
+    }
+
+    // the records the next sealed block will hold, views stay valid until seal()
+    std::vector<RecordView> sealable() const
+    {
+        auto& records = _tail.records();
+        return std::vector<RecordView>(records.begin(), records.begin() + std::min(records.size(), RECORDS_BLOCK_MAX_SIZE));
+    }
+
+    // writes records into one block file and drops their single record files,
+    // safe to run off the event loop thread; returns the size of the new files
+    static size_t write_block(const std::string& name, const std::vector<RecordView>& records)
+    {
+        size_t first = records.front()._pos;
+        size_t last = records.back()._pos;
+        boost::filesystem::path rfn = RecordsBlock::path(name, first, last);
+        boost::filesystem::path rfnt = rfn.string() + ".tmp";
+
+        TimeIndex times;
+        for(auto& r : records)
+            index_time(times, r._pos, r._time);
+        RecordsBlock::write_times(RecordsBlock::times_path(name, first, last), times);
+
+        std::ofstream out(rfnt.c_str());
+        for(auto& r : records) {
+            out.write(r._data.data(), r._data.size());
+            out << "\n";
+        }
+        finish_file(out, rfnt);
+        sync_path(rfnt);
+
+        if(std::rename(rfnt.c_str(), rfn.c_str()) != 0)
+            throw std::runtime_error("Can't rename block tmp file name");
+
+        // the single record files go away below, the block and its index
+        // must survive a crash before that
+        sync_path(QUEUES_DIR);
+
+        // the block is complete on disk, leftovers after a crash are dropped on load
+        // as internal to the block
+        for(size_t pos = first; pos <= last; ++pos)
+            std::remove(RecordsBlock::path(name, pos, pos).c_str());
+
+        return RecordsBlock::disk_bytes(name, first, last);
     }
 
-    const Record& at(size_t pos)
+    // the block file for tail records up to last is on disk, release their memory
+    void seal(size_t last, size_t disk_bytes)
     {
-        if(!_records.empty() && _records.front()._pos <= pos && _records.back()._pos >= pos)
-            return _records[pos - _records.front()._pos];
+        _blocks.emplace_back(_name, _tail.first(), last);
+        _blocks.back()._disk_bytes = disk_bytes;
+        _blocks.back()._files = 2;
+        _blocks_disk_bytes += disk_bytes;
+        _blocks_files += 2;
+        for(auto& r : _tail.records()) {
+            if(r._pos > last)
+                break;
+            index_time(_blocks.back()._times, r._pos, r._time);
+        }
+        if(!_blocks.back()._times.empty())
+            _block_times.push_back(BlockTime{_blocks.back()._times.back()._time, &_blocks.back()});
+        _tail.release(last);
+    }
+
+    // blocks sealed before time indexing existed have no index and never match a seek
+    void index_blocks()
+    {
+        _block_times.clear();
         for(auto& rb : _blocks)
-            if(rb._first <= pos && rb._last >= pos) {
-                rb.load();
-                return rb._records[pos - rb._first];
-            }
+            if(!rb._times.empty())
+                _block_times.push_back(BlockTime{rb._times.back()._time, &rb});
+    }
+
+    // first position appended at or after time, next() if there is none yet;
+    // only the resident time indexes are used, block payloads stay on disk
+    size_t seek(uint64_t time) const
+    {
+        auto bt = std::lower_bound(_block_times.begin(), _block_times.end(), time, [](auto& b, uint64_t time) {
+            return b._time < time;
+        });
+        if(bt != _block_times.end()) {
+            auto& times = bt->_block->_times;
+            return std::lower_bound(times.begin(), times.end(), time, [](auto& t, uint64_t time) {
+                return t._time < time;
+            })->_pos;
+        }
+
+        auto& records = _tail.records();
+        auto it = std::lower_bound(records.begin(), records.end(), time, [](auto& r, uint64_t time) {
+            return r._time < time;
+        });
+        return it != records.end() ? it->_pos : next();
+    }
+
+    // a block read from disk joins the queue
+    void add_block(RecordsBlock&& rb)
+    {
+        _blocks_resident += rb.resident();
+        _blocks_disk_bytes += rb._disk_bytes;
+        _blocks_files += rb._files;
+        _blocks.emplace_front(std::move(rb));
+    }
+
+    void load(RecordsBlock& rb)
+    {
+        size_t before = rb.resident();
+        rb.load();
+        _blocks_resident += rb.resident() - before;
+    }
+
+    // a payload read off the loop, dropped when the block got loaded meanwhile
+    void install(RecordsBlock& rb, BlockPayload&& payload)
+    {
+        if(rb.loaded())
+            return;
+        rb._payload = std::move(payload);
+        _blocks_resident += rb.resident();
+    }
+
+    void unload(RecordsBlock& rb)
+    {
+        _blocks_resident -= rb.resident();
+        rb.unload();
+    }
+
+    // memory held by the tail and the loaded blocks
+    size_t resident() const
+    {
+        return _tail.resident() + _blocks_resident;
+    }
+
+    size_t disk_bytes() const
+    {
+        return _tail.disk_bytes() + _blocks_disk_bytes;
+    }
+
+    size_t files() const
+    {
+        return _tail.size() + _blocks_files;
+    }
+
+    RecordsBlock* block(size_t pos)
+    {
+        for(auto& rb : _blocks)
+            if(rb._first <= pos && rb._last >= pos)
+                return &rb;
+        return nullptr;
+    }
+
+    RecordView at(size_t pos)
+    {
+        if(_tail.contains(pos))
+            return _tail.at(pos);
+        RecordsBlock* rb = block(pos);
+        if(rb == nullptr)
+            throw std::out_of_range(_name + " : no record at " + std::to_string(pos));
+        load(*rb);
+        return rb->at(pos);
+    }
+
+    Encoded wire(size_t pos)
+    {
+        if(_tail.contains(pos))
+            return _tail.wire(pos);
+        RecordsBlock* rb = block(pos);
+        if(rb == nullptr)
+            throw std::out_of_range(_name + " : no record at " + std::to_string(pos));
+        load(*rb);
+        return rb->wire(pos);
     }
 };
 
 using QueuePtr = std::shared_ptr<Queue>;
-using QueueMap = std::map<std::string, QueuePtr>;
 using RecordsBlocks = std::vector<RecordsBlock>;
 
+const size_t QUEUES_SHARDS = 64;
+
+// The registry is safe to use from any thread, the queues it holds are not.
+// Names are spread over shards with a reader-writer lock each, so lookups
+// from different loops share the lock and adding a queue only blocks its shard.
 struct Queues {
-    QueueMap _qm;
+    struct Shard {
+        mutable std::shared_timed_mutex _lock;
+        std::unordered_map<std::string, QueuePtr> _by_name;
+    };
+
+    std::array<Shard, QUEUES_SHARDS> _shards;
+    std::atomic<QueueId> _next_id;
+
+    Queues() : _next_id(0) {}
+
+    Shard& shard(const std::string& name)
+    {
+        return _shards[std::hash<std::string>()(name) % QUEUES_SHARDS];
+    }
+
+    const Shard& shard(const std::string& name) const
+    {
+        return _shards[std::hash<std::string>()(name) % QUEUES_SHARDS];
+    }
+
+    QueuePtr find(const std::string& name) const
+    {
+        const Shard& sh = shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(sh._lock);
+        auto qit = sh._by_name.find(name);
+        return qit != sh._by_name.end() ? qit->second : nullptr;
+    }
 
     QueuePtr queue(const std::string& name)
     {
-        auto qit = _qm.find(name);
-        if(qit == _qm.end()) {
-            auto p = _qm.emplace(name, std::make_shared<Queue>(name));
-            qit = p.first;
+        QueuePtr q = find(name);
+        if(q != nullptr)
+            return q;
+
+        Shard& sh = shard(name);
+        std::unique_lock<std::shared_timed_mutex> lock(sh._lock);
+
+        // somebody may have added it while this thread was waiting
+        auto qit = sh._by_name.find(name);
+        if(qit != sh._by_name.end())
+            return qit->second;
+
+        q = std::make_shared<Queue>(name, _next_id++);
+        sh._by_name.emplace(name, q);
+        return q;
+    }
+
+    // every queue known now, sorted by name; for LIST, DUMP and globs
+    std::vector<QueuePtr> list() const
+    {
+        std::vector<QueuePtr> queues;
+        for(auto& sh : _shards) {
+            std::shared_lock<std::shared_timed_mutex> lock(sh._lock);
+            for(auto& q : sh._by_name)
+                queues.push_back(q.second);
         }
-        return qit->second;
+        std::sort(queues.begin(), queues.end(), [](auto& a, auto& b) {
+            return a->_name < b->_name;
+        });
+        return queues;
     }
 
     void load()
     {
         RecordsBlocks rbs;
+        std::vector<boost::filesystem::path> idxs;
 
         for(auto itp = boost::filesystem::directory_iterator(QUEUES_DIR); itp != boost::filesystem::directory_iterator(); itp++) {
             if(!boost::filesystem::is_regular_file(itp->path()))
                 continue;
 
+            // groups point into the file name, so it must outlive them
+            std::string filename = itp->path().filename().string();
             boost::cmatch groups;
-            if(!boost::regex_match(itp->path().filename().c_str(), groups, RB_FILE_NAME_PATTERN))
+            if(boost::regex_match(filename.c_str(), groups, IDX_FILE_NAME_PATTERN)) {
+                // a crash before the block rename leaves its index alone
+                if(groups[4] == ".tmp" || !boost::filesystem::exists(RecordsBlock::path(groups[1], std::stoul(groups[2]), std::stoul(groups[3]))))
+                    idxs.push_back(itp->path());
+                continue;
+            }
+            if(!boost::regex_match(filename.c_str(), groups, RB_FILE_NAME_PATTERN))
                 continue;
 
             std::cerr << "found: " << itp->path() << std::endl;
@@ -167,6 +864,11 @@ struct Queues {
             rbs.emplace_back(itp->path(), groups);
         }
 
+        for(auto& p : idxs) {
+            std::cerr << "Orphan index found: " << p << std::endl;
+            std::remove(p.c_str());
+        }
+
         std::sort(rbs.begin(), rbs.end(), [](auto& a, auto& b) {
             return
                 a._name == b._name ?
@@ -178,7 +880,8 @@ struct Queues {
                 : a._name < b._name;
         });
 
-        std::map<std::string, RecordsBlocks> queues;
+        // single record files come newest first, the tail can only grow at its end
+        std::map<std::string, std::deque<Record>> tails;
         for(auto& rb : rbs) {
             std::cerr << "block: " << rb._path << std::endl;
             if(rb._tmp) {
@@ -187,43 +890,68 @@ struct Queues {
             }
 
             QueuePtr q = queue(rb._name);
+            auto& tail = tails[rb._name];
 
             if(q->_blocks.empty() && rb._last == rb._first) {
                 std::cerr << "New queue found: " << rb._name << std::endl;
                 rb.load();
-                q->_records.emplace_front(std::move(rb._records.front()));
+                RecordView r = rb.at(rb._first);
+                tail.emplace_front(r._pos, r._data.to_string(), r._time);
                 continue;
             }
 
-            if(rb._first >= q->_blocks.front()._first && rb._last <= q->_blocks.front()._last) {
+            if(!q->_blocks.empty() && rb._first >= q->_blocks.front()._first && rb._last <= q->_blocks.front()._last) {
                 std::cerr << "Internal block found: " << rb._path << std::endl;
                 // std::remove(rb._path.c_str());
                 continue;
             }
 
-            if(!q->empty() && rb._last + 1 != q->first()) {
+            size_t first = q->_blocks.empty() ? (tail.empty() ? 0 : tail.front()._pos) : q->_blocks.front()._first;
+            if((!q->_blocks.empty() || !tail.empty()) && rb._last + 1 != first) {
                 std::cerr << "Broken sequence in queue '" << rb._name << std::endl;
                 break;
             }
 
-            q->_blocks.emplace_front(std::move(rb));
+            rb.read_times();
+            rb.stat();
+            q->add_block(std::move(rb));
         }
 
-        for(auto& qp : _qm) {
-            std::cerr << "queue: '" << qp.first << '"' << std::endl;
+        for(auto& t : tails) {
+            QueuePtr q = queue(t.first);
+            for(auto& r : t.second)
+                q->_tail.append(r._pos, r._data, r._time);
+
+            q->_published = q->next();
+            q->_stored = q->next();
+
+            if(!q->_tail.empty())
+                q->_last_time = q->_tail.records().back()._time;
+            else if(!q->_blocks.empty() && !q->_blocks.back()._times.empty())
+                q->_last_time = q->_blocks.back()._times.back()._time;
+        }
+
+        for(auto& q : list()) {
+            q->index_blocks();
+
+            std::cerr << "queue: '" << q->_name << '"' << std::endl;
             std::cerr << "\tblocks" << std::endl;
-            for(auto& rb : qp.second->_blocks) {
+            for(auto& rb : q->_blocks) {
                 std::cerr << "\t\t" << rb._path << '\t' << rb._first << '\t' << rb._last << std::endl;
-                rb.load();
-                for(auto& r : rb._records)
-                    std::cerr << "\t\t\t" << r._pos << '\t' << r._data << std::endl;
+                q->load(rb);
+                for(size_t pos = rb._first; pos <= rb._last; ++pos)
+                    std::cerr << "\t\t\t" << pos << '\t' << rb.at(pos)._data << std::endl;
             }
             std::cerr << "\trecords" << std::endl;
-            for(auto& r : qp.second->_records)
+            for(auto& r : q->_tail.records())
                 std::cerr << "\t\t" << r._pos << '\t' << r._data << std::endl;
-            std::cerr << "\tfirst: " << qp.second->first() << "; last: " << qp.second->last() << std::endl;
-            for(size_t n = qp.second->first(); n <= qp.second->last(); ++n)
-                std::cerr << '\t' << "[" << n << "]: " << qp.second->at(n)._pos << " : " << qp.second->at(n)._data << std::endl;
+            std::cerr << "\tfirst: " << q->first() << "; last: " << q->last() << std::endl;
+            for(size_t n = q->first(); n <= q->last(); ++n)
+                std::cerr << '\t' << "[" << n << "]: " << q->at(n)._pos << " : " << q->at(n)._data << std::endl;
+
+            // blocks come back on demand, see Storage::wire
+            for(auto& rb : q->_blocks)
+                q->unload(rb);
         }
     }
 };
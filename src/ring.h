@@ -0,0 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <boost/utility/string_ref.hpp>
+
+const uint32_t RING_MAGIC = 0x52515232;
+const uint32_t RING_DEFAULT_SLOTS = 4096;
+const uint32_t RING_DEFAULT_SLOT_SIZE = 1024;
+
+// Bounded ring of PUSH requests in memory shared with local producers.
+// Any number of producers reserve slots with a CAS on _head, the server is
+// the only consumer. A slot sequence number tells whose turn it is:
+// pos for a free slot, pos + 1 for a filled one. The geometry is fixed when
+// a Ring is made, fields that producers can write are never trusted for it.
+struct RingHeader {
+    uint32_t _magic;
+    uint32_t _slots;
+    uint32_t _slot_size;
+    alignas(64) std::atomic<uint64_t> _head;
+    alignas(64) std::atomic<uint64_t> _tail;
+    // the consumer sleeps on _bell when the ring runs dry, producers ring it
+    alignas(64) std::atomic<uint32_t> _bell;
+    std::atomic<uint32_t> _sleeping;
+};
+
+struct RingSlot {
+    std::atomic<uint64_t> _seq;
+    uint32_t _name_size;
+    uint32_t _data_size;
+};
+
+class Ring
+{
+private:
+    RingHeader* _header;
+    uint32_t _slots;
+    uint32_t _slot_size;
+
+    RingSlot* slot(uint64_t pos) const
+    {
+        char* slots = reinterpret_cast<char*>(_header + 1);
+        return reinterpret_cast<RingSlot*>(slots + (pos % _slots) * _slot_size);
+    }
+
+    static char* payload(RingSlot* s)
+    {
+        return reinterpret_cast<char*>(s + 1);
+    }
+
+    // not private, the bell is shared between processes
+    static long futex(std::atomic<uint32_t>& word, int op, uint32_t value, const timespec* timeout)
+    {
+        return ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+    }
+
+public:
+    Ring(void* memory, uint32_t slots, uint32_t slot_size) :
+        _header(static_cast<RingHeader*>(memory)), _slots(slots), _slot_size(slot_size)
+    {}
+
+    static size_t size(uint32_t slots, uint32_t slot_size)
+    {
+        return sizeof(RingHeader) + size_t(slots) * slot_size;
+    }
+
+    void init()
+    {
+        if(_slots == 0 || _slot_size < sizeof(RingSlot) + 2 || _slot_size % alignof(RingSlot) != 0)
+            throw std::runtime_error("ring slot size is too small or misaligned");
+
+        _header->_slots = _slots;
+        _header->_slot_size = _slot_size;
+        _header->_head.store(0);
+        _header->_tail.store(0);
+        _header->_bell.store(0);
+        _header->_sleeping.store(0);
+        for(uint64_t pos = 0; pos < _slots; ++pos)
+            slot(pos)->_seq.store(pos);
+        std::atomic_thread_fence(std::memory_order_release);
+        _header->_magic = RING_MAGIC;
+    }
+
+    bool valid() const
+    {
+        return _header->_magic == RING_MAGIC;
+    }
+
+    size_t capacity() const
+    {
+        return _slot_size - sizeof(RingSlot);
+    }
+
+    // false when the ring is full or the record does not fit a slot
+    bool push(boost::string_ref name, boost::string_ref data)
+    {
+        if(name.size() + data.size() > capacity())
+            return false;
+
+        uint64_t pos = _header->_head.load(std::memory_order_relaxed);
+        RingSlot* s;
+        while(true) {
+            s = slot(pos);
+            int64_t diff = int64_t(s->_seq.load(std::memory_order_acquire)) - int64_t(pos);
+            if(diff == 0) {
+                if(_header->_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if(diff < 0)
+                return false;
+            else
+                pos = _header->_head.load(std::memory_order_relaxed);
+        }
+
+        s->_name_size = name.size();
+        s->_data_size = data.size();
+        std::memcpy(payload(s), name.data(), name.size());
+        std::memcpy(payload(s) + name.size(), data.data(), data.size());
+        s->_seq.store(pos + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    // wakes the consumer if it sleeps in wait(), costs a fence when it does not
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_header->_sleeping.load(std::memory_order_relaxed) == 0)
+            return;
+        _header->_bell.fetch_add(1);
+        futex(_header->_bell, FUTEX_WAKE, 1, nullptr);
+    }
+
+    // consumer side only, true when pop() has something to take
+    bool ready() const
+    {
+        uint64_t pos = _header->_tail.load(std::memory_order_relaxed);
+        return slot(pos)->_seq.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    // consumer side only, sleeps until a producer pushes or timeout passes
+    void wait(std::chrono::milliseconds timeout)
+    {
+        uint32_t bell = _header->_bell.load();
+        _header->_sleeping.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!ready()) {
+            timespec ts{time_t(timeout.count() / 1000), long(timeout.count() % 1000 * 1000000)};
+            futex(_header->_bell, FUTEX_WAIT, bell, &ts);
+        }
+        _header->_sleeping.store(0);
+    }
+
+    // consumer side only, false when there is nothing to take; a slot whose sizes
+    // do not fit is released and comes out with an empty name
+    bool pop(std::string& name, std::string& data)
+    {
+        uint64_t pos = _header->_tail.load(std::memory_order_relaxed);
+        RingSlot* s = slot(pos);
+        if(s->_seq.load(std::memory_order_acquire) != pos + 1)
+            return false;
+
+        uint64_t name_size = s->_name_size;
+        uint64_t data_size = s->_data_size;
+        if(name_size + data_size > capacity()) {
+            name.clear();
+            data.clear();
+        } else {
+            name.assign(payload(s), name_size);
+            data.assign(payload(s) + name_size, data_size);
+        }
+
+        s->_seq.store(pos + _slots, std::memory_order_release);
+        _header->_tail.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// POSIX shared memory segment holding a Ring. The server creates it,
+// producers on the same host open it by name.
+class ShmRing
+{
+private:
+    std::string _name;
+    bool _owner;
+    void* _memory;
+    size_t _size;
+    uint32_t _slots;
+    uint32_t _slot_size;
+
+    void map(int fd, size_t size)
+    {
+        _size = size;
+        _memory = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(_memory == MAP_FAILED)
+            throw std::runtime_error("Can't map shared memory '" + _name + "'");
+    }
+
+public:
+    ShmRing(const std::string& name, uint32_t slots, uint32_t slot_size) :
+        _name(name), _owner(true), _slots(slots), _slot_size(slot_size)
+    {
+        // another server may be using it, a stale one is left for the admin to remove
+        int fd = ::shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0 && errno == EEXIST)
+            throw std::runtime_error("Shared memory '" + _name + "' already exists, remove it if no server uses it");
+        if(fd < 0)
+            throw std::runtime_error("Can't create shared memory '" + _name + "'");
+        if(::ftruncate(fd, Ring::size(slots, slot_size)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Can't size shared memory '" + _name + "'");
+        }
+        map(fd, Ring::size(slots, slot_size));
+        ring().init();
+    }
+
+    explicit ShmRing(const std::string& name) : _name(name), _owner(false)
+    {
+        int fd = ::shm_open(_name.c_str(), O_RDWR, 0);
+        if(fd < 0)
+            throw std::runtime_error("Can't open shared memory '" + _name + "'");
+        struct stat st;
+        if(::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(RingHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Broken shared memory '" + _name + "'");
+        }
+        map(fd, st.st_size);
+
+        RingHeader* h = static_cast<RingHeader*>(_memory);
+        _slots = h->_slots;
+        _slot_size = h->_slot_size;
+        if(h->_magic != RING_MAGIC || _slots == 0 || _slot_size <= sizeof(RingSlot) || Ring::size(_slots, _slot_size) > _size) {
+            ::munmap(_memory, _size);
+            throw std::runtime_error("Shared memory '" + _name + "' holds no ring");
+        }
+    }
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    ~ShmRing()
+    {
+        ::munmap(_memory, _size);
+        if(_owner)
+            ::shm_unlink(_name.c_str());
+    }
+
+    Ring ring()
+    {
+        return Ring(_memory, _slots, _slot_size);
+    }
+};
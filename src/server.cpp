@@ -1,59 +1,243 @@
-
 #include <iostream>
 #include <exception>
 #include <map>
+#include <vector>
+#include <memory>
+#include <thread>
+
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 
 #include "../bin/version.h"
 
 #include "queue.h"
+#include "loops.h"
+#include "storage.h"
+#include "subscription.h"
+#include "backpressure.h"
 #include "session.h"
+#include "ingest.h"
+
+int usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " <port> [storage threads] [--loops <count>] [--unix <socket path>] [--shm <ring name>]"
+        " [--max-connections <count>] [--max-inbound <bytes>] [--max-outstanding <bytes>]" << std::endl;
+    return 1;
+}
+
+// asio has no SO_REUSEPORT option, a SettableSocketOption of our own
+class reuse_port
+{
+private:
+    int _value;
+
+public:
+    explicit reuse_port(bool value) : _value(value ? 1 : 0) {}
+
+    template<typename Protocol>
+    int level(const Protocol&) const
+    {
+        return SOL_SOCKET;
+    }
+
+    template<typename Protocol>
+    int name(const Protocol&) const
+    {
+        return SO_REUSEPORT;
+    }
+
+    template<typename Protocol>
+    const void* data(const Protocol&) const
+    {
+        return &_value;
+    }
+
+    template<typename Protocol>
+    size_t size(const Protocol&) const
+    {
+        return sizeof(_value);
+    }
+};
+
+template<typename Acceptor>
+void serve(boost::asio::io_service& io, Acceptor& acceptor, Queues& qs, Storage& st, Loops& loops, Subscribers& subs, Limits& limits, Metrics& m)
+{
+    boost::asio::spawn(io,
+    [&](boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        while(true) {
+            Socket socket(io);
+            acceptor.async_accept(socket, yield[ec]);
+            if (ec) {
+                if(ec == boost::asio::error::operation_aborted)
+                    break;
+                std::cerr << "accept error: " << ec;
+                break;
+            }
+            if(!limits.admit()) {
+                // a short line into an empty socket buffer does not block
+                m.update("session.errors.rejected", 1);
+                boost::asio::write(socket, boost::asio::buffer(std::string("ERR too many connections\n")), ec);
+                socket.close(ec);
+                continue;
+            }
+            // replies are small, don't let them wait for acks; unix sockets refuse it
+            socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+            std::make_shared<Session>(std::move(socket), qs, st, loops, subs, limits, m)->go();
+        }
+    });
+}
+
+// A socket left behind by a server that is gone may be replaced, a live one
+// or anything that is not a socket stays where it is.
+void clear_unix_path(const std::string& path)
+{
+    struct stat st;
+    if(::lstat(path.c_str(), &st) != 0) {
+        if(errno == ENOENT)
+            return;
+        throw std::runtime_error("Can't check unix socket path '" + path + "'");
+    }
+    if(!S_ISSOCK(st.st_mode))
+        throw std::runtime_error("'" + path + "' exists and is not a socket");
+
+    boost::asio::io_service io;
+    boost::asio::local::stream_protocol::socket probe(io);
+    boost::system::error_code ec;
+    probe.connect(boost::asio::local::stream_protocol::endpoint(path), ec);
+    if(!ec)
+        throw std::runtime_error("Another server listens on '" + path + "'");
+
+    if(::unlink(path.c_str()) != 0)
+        throw std::runtime_error("Can't remove stale unix socket '" + path + "'");
+}
+
+// With several loops every one accepts on its own SO_REUSEPORT socket,
+// the kernel spreads connections between them.
+std::unique_ptr<boost::asio::ip::tcp::acceptor> listen(boost::asio::io_service& io, unsigned short port, bool shared)
+{
+    boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), port);
+    auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(io);
+    acceptor->open(ep.protocol());
+    acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    if(shared)
+        acceptor->set_option(reuse_port(true));
+    acceptor->bind(ep);
+    acceptor->listen();
+    return acceptor;
+}
 
 int main(int argc, char** argv)
 {
     try {
-        if(argc != 2) {
-            std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+        std::vector<std::string> args;
+        std::map<std::string, std::string> options;
+        for(int n = 1; n < argc; ++n) {
+            std::string arg = argv[n];
+            if(arg.compare(0, 2, "--") != 0)
+                args.push_back(arg);
+            else if(n + 1 < argc && (arg == "--unix" || arg == "--shm" || arg == "--loops" ||
+                    arg == "--max-connections" || arg == "--max-inbound" || arg == "--max-outstanding"))
+                options[arg.substr(2)] = argv[++n];
+            else
+                return usage(argv[0]);
+        }
+
+        if(args.size() < 1 || args.size() > 2)
+            return usage(argv[0]);
+
+        size_t storage_threads = args.size() > 1 ? std::stoul(args[1]) : 2;
+        if(storage_threads == 0) {
+            std::cerr << "storage threads must be positive" << std::endl;
+            return 1;
+        }
+
+        // 0 means a loop per core
+        size_t loops_count = options.count("loops") ? std::stoul(options["loops"]) : 1;
+        if(loops_count == 0)
+            loops_count = std::max(1u, std::thread::hardware_concurrency());
+
+        Limits limits;
+        if(options.count("max-connections"))
+            limits._max_connections = std::stoul(options["max-connections"]);
+        if(options.count("max-inbound"))
+            limits._max_inbound = std::stoul(options["max-inbound"]);
+        if(options.count("max-outstanding"))
+            limits._max_outstanding = std::stoul(options["max-outstanding"]);
+        if(limits._max_inbound == 0 || limits._max_outstanding == 0) {
+            std::cerr << "inbound and outstanding limits must be positive" << std::endl;
             return 1;
         }
 
-        Metrics m;
         Queues qs;
         qs.load();
 
-        boost::asio::io_service io;
+        Loops loops(loops_count);
+        Storage st(loops, storage_threads);
+        Subscribers subs;
+
+        // loops count on their own and get merged at exit
+        std::vector<Metrics> ms(loops.size());
 
+        boost::asio::io_service& io = loops.at(0);
         boost::asio::signal_set sigint(io, SIGINT);
-        boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), std::atoi(argv[1])));
+
+        std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+        for(size_t n = 0; n < loops.size(); ++n) {
+            acceptors.push_back(listen(loops.at(n), std::stoi(args[0]), loops.size() > 1));
+            serve(loops.at(n), *acceptors.back(), qs, st, loops, subs, limits, ms[n]);
+        }
+
+        // local producers may skip the TCP stack
+        std::unique_ptr<boost::asio::local::stream_protocol::acceptor> local;
+        if(options.count("unix")) {
+            clear_unix_path(options["unix"]);
+            local = std::make_unique<boost::asio::local::stream_protocol::acceptor>(io, boost::asio::local::stream_protocol::endpoint(options["unix"]));
+            serve(io, *local, qs, st, loops, subs, limits, ms[0]);
+        }
+
+        std::unique_ptr<Ingest> ingest;
+        if(options.count("shm")) {
+            ingest = std::make_unique<Ingest>(io, options["shm"], qs, st, subs, ms[0]);
+            ingest->go();
+        }
 
         sigint.async_wait(
         [&](boost::system::error_code ec, int signal) {
             std::cerr << "finish" << std::endl;
-            acceptor.close();
+            for(size_t n = 0; n < loops.size(); ++n)
+                loops.at(n).post([&acceptors, n]() {
+                    acceptors[n]->close();
+                });
+            if(local != nullptr)
+                local->close();
+            if(ingest != nullptr)
+                ingest->stop();
         });
 
-        boost::asio::spawn(io,
-        [&](boost::asio::yield_context yield) {
-            boost::system::error_code ec;
-            while (listen) {
-                boost::asio::ip::tcp::socket socket(io);
-                acceptor.async_accept(socket, yield[ec]);
-                if (ec) {
-                    if(ec == boost::asio::error::operation_aborted)
-                        break;
-                    std::cerr << "accept error: " << ec;
-                    break;
-                }
-                std::make_shared<Session>(std::move(socket), qs, m)->go();
-            }
-        });
-
-
+        std::vector<std::thread> threads;
+        for(size_t n = 1; n < loops.size(); ++n)
+            threads.emplace_back([&loops, n]() {
+                loops.at(n).run();
+            });
         io.run();
+        for(auto& t : threads)
+            t.join();
+
+        if(local != nullptr)
+            ::unlink(options["unix"].c_str());
 
+        Metrics m;
+        for(auto& lm : ms)
+            m.update(lm.metrics());
+        m.update(st.metrics());
         m.dump("rq_server", std::cout);
 
     } catch(std::exception& e) {
@@ -7,6 +7,9 @@
 #include <array>
 #include <vector>
 #include <map>
+#include <string>
+#include <sstream>
+#include <cstring>
 
 #include <boost/asio/spawn.hpp>
 #include <boost/tokenizer.hpp>
@@ -14,18 +17,43 @@
 
 #include "metrics.h"
 #include "queue.h"
+#include "storage.h"
+#include "subscription.h"
+#include "backpressure.h"
 #include "command.h"
 
+std::string describe(const Socket& socket)
+{
+    boost::system::error_code ec;
+    Socket::endpoint_type ep = socket.remote_endpoint(ec);
+    if(ec)
+        return "unknown";
+    if(ep.protocol().family() == AF_UNIX)
+        return "unix";
+
+    boost::asio::ip::tcp::endpoint tcp;
+    std::memcpy(tcp.data(), ep.data(), std::min(ep.size(), tcp.capacity()));
+    tcp.resize(std::min(ep.size(), tcp.capacity()));
+
+    std::ostringstream out;
+    out << tcp;
+    return out.str();
+}
+
 class Session : public std::enable_shared_from_this<Session>
 {
 private:
     Metrics& _m;
     Queues& _qs;
+    Storage& _st;
+    Subscribers& _subs;
+    Limits& _limits;
 
-    boost::asio::ip::tcp::socket _socket;
+    Socket _socket;
     boost::asio::io_service::strand _strand;
+    std::shared_ptr<Outbound<Socket>> _out;
 
-    boost::asio::ip::tcp::endpoint _remote;
+    std::string _remote;
 
     std::array<char, 8192> _buffer;
     std::string _data;
@@ -33,6 +61,11 @@ private:
     bool _echo_cmd;
     bool _local_print_cmd;
 
+    // the pump streams subscribed records between commands only
+    bool _streaming;
+    Signal _idle;
+    std::weak_ptr<Subscriber> _pumped;
+
     CommandState _s;
     Commands _commands;
 
@@ -47,8 +80,12 @@ private:
 
         _m.update("session.lines", 1);
 
+        _s._busy = true;
+        while(_streaming)
+            _idle.wait(yield);
+
         if(_echo_cmd) {
-            boost::asio::async_write(_socket, boost::asio::buffer(_data.c_str() + start, length), yield[ec]);
+            _out->write(_data.substr(start, length), yield, ec);
             if(ec) {
                 std::cerr << "sesion error: " << ec << std::endl;
                 return;
@@ -89,13 +126,65 @@ private:
         }
 
         response += "\n";
-        boost::asio::async_write(_socket, boost::asio::buffer(response, response.length()), yield[ec]);
-        if(ec) {
+        _out->write(std::move(response), yield, ec);
+        if(ec)
             std::cerr << "sesion error: " << ec << std::endl;
-            return;
+
+        _s._busy = false;
+        if(_s._sub != nullptr) {
+            if(_pumped.lock() != _s._sub)
+                pump(_s._sub);
+            _s._sub->_wake.notify();
         }
     }
 
+    void pump(SubscriberPtr sub)
+    {
+        _pumped = sub;
+
+        auto self(shared_from_this());
+        boost::asio::spawn(_strand,
+        [this, self, sub](boost::asio::yield_context yield) {
+            boost::system::error_code ec;
+            Subscription next;
+            ReadAhead ahead;
+            // too long for the small string buffer, built once and not per record
+            const std::string streamed("session.streamed");
+            while(sub->_active) {
+                if(_s._busy || !sub->ready(next)) {
+                    sub->_wake.wait(yield);
+                    continue;
+                }
+
+                _streaming = true;
+
+                // the tag and the record go out as buffers every other reader shares
+                Encoded tag = next._q->_msg;
+                Encoded data;
+                try {
+                    data = _st.wire(*next._q, next._p, ahead, _strand, yield);
+                } catch(std::exception& e) {
+                    std::cerr << "storage error: " << e.what() << std::endl;
+                    tag = encode("ERR storage error\t" + next._q->_name + '\t');
+                    data = encode(std::to_string(next._p) + '\n');
+                }
+
+                _out->write(std::move(tag), yield, ec);
+                if(!ec)
+                    _out->write(std::move(data), yield, ec);
+
+                _streaming = false;
+                _idle.notify();
+
+                if(ec) {
+                    std::cerr << "sesion error: " << ec << std::endl;
+                    break;
+                }
+                _m.update(streamed, 1);
+            }
+        });
+    }
+
     void process_data(boost::asio::yield_context& yield)
     {
         _m.update("session.reads", 1);
@@ -116,14 +205,20 @@ private:
     }
 
 public:
-    explicit Session(boost::asio::ip::tcp::socket socket, Queues& qs, Metrics& m)
+    explicit Session(Socket socket, Queues& qs, Storage& st, Loops& loops, Subscribers& subs, Limits& limits, Metrics& m)
         : _m(m),
+          _limits(limits),
           _socket(std::move(socket)),
           _strand(_socket.get_io_service()),
+          _out(std::make_shared<Outbound<Socket>>(_socket, _strand, limits._max_outstanding)),
           _qs(qs),
+          _st(st),
+          _subs(subs),
           _echo_cmd(true),
           _local_print_cmd(true),
-          _s(m, qs, _socket, _strand)
+          _streaming(false),
+          _idle(_socket.get_io_service()),
+          _s(m, qs, st, loops, subs, *_out, _strand)
     {
         _m.update("session.count", 1);
 
@@ -133,15 +228,24 @@ public:
         add_command(std::make_unique<CPush>(_s));
         add_command(std::make_unique<CPop>(_s));
         add_command(std::make_unique<CDump>(_s));
+        add_command(std::make_unique<CSubscribe>(_s));
+        add_command(std::make_unique<CCredit>(_s));
+        add_command(std::make_unique<CUnsubscribe>(_s));
         add_command(std::make_unique<CHelp>(_s));
 
-        boost::system::error_code ec;
-        _remote = std::move(_socket.remote_endpoint(ec));
+        _remote = describe(_socket);
 
         if(_local_print_cmd)
             std::cout << "New session: " << _remote << std::endl;
     }
 
+    // the connection was admitted by the acceptor
+    ~Session()
+    {
+        _out->close();
+        _limits.leave();
+    }
+
     void go()
     {
         auto self(shared_from_this());
@@ -152,7 +256,9 @@ public:
 
             boost::system::error_code ec;
             while(true) {
-                std::size_t length = _socket.async_read_some(boost::asio::buffer(_buffer.data(), _buffer.size()), yield[ec]);
+                // never buffer more than an unfinished line of _max_inbound
+                size_t room = std::min(_buffer.size(), _limits._max_inbound - _data.size());
+                std::size_t length = _socket.async_read_some(boost::asio::buffer(_buffer.data(), room), yield[ec]);
                 if (ec) {
                     if(ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset)
                         break;
@@ -162,6 +268,28 @@ public:
 
                 _data.append(_buffer.data(), length);
                 process_data(yield);
+
+                if(_out->stalled()) {
+                    _m.update("session.errors.stalled", 1);
+                    std::cerr << _remote << " disconnected: does not read responses" << std::endl;
+                    break;
+                }
+
+                if(_data.size() >= _limits._max_inbound) {
+                    _m.update("session.errors.inbound", 1);
+                    response = "ERR line too long\n";
+                    _out->write(std::move(response), yield, ec);
+                    std::cerr << _remote << " disconnected: line too long" << std::endl;
+                    break;
+                }
+            }
+
+            // responses still queued go out before the session ends
+            _out->drain(yield, ec);
+
+            if(_s._sub != nullptr) {
+                _s._sub->_active = false;
+                _s._sub->_wake.notify();
             }
         });
     }
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <exception>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include "metrics.h"
+#include "queue.h"
+#include "loops.h"
+#include "subscription.h"
+
+// What one reader was served last. Storage reads the next block ahead only
+// for readers that go record after record.
+struct ReadAhead {
+    size_t _queue;
+    size_t _last;
+
+    ReadAhead() : _queue(size_t(-1)), _last(0) {}
+
+    // true when pos follows the record served before it in the same queue
+    bool follows(const Queue& q, size_t pos)
+    {
+        bool sequential = _queue == q._id && pos == _last + 1;
+        _queue = q._id;
+        _last = pos;
+        return sequential;
+    }
+};
+
+// Thread pool for blocking disk operations. Sessions submit work here and
+// stay suspended until it is done, so the event loops keep serving other
+// connections. Writes to one queue are serialized by a per-queue strand,
+// reads of sealed blocks, which never change, run beside them; in-memory
+// queue state is touched on the queue owner loop only.
+class Storage
+{
+private:
+    Loops& _loops;
+
+    boost::asio::io_service _io;
+    std::unique_ptr<boost::asio::io_service::work> _work;
+    std::vector<std::thread> _threads;
+
+    std::mutex _order_lock;
+    std::vector<std::unique_ptr<boost::asio::io_service::strand>> _order;
+
+    std::atomic<size_t> _prefetch_reads;
+    std::atomic<size_t> _prefetch_hits;
+    std::atomic<size_t> _prefetch_misses;
+    std::atomic<size_t> _prefetch_waits;
+
+    boost::asio::io_service::strand& order(const Queue& q)
+    {
+        // the lock is taken once per queue, on its first write
+        boost::asio::io_service::strand* strand = q._order.load(std::memory_order_acquire);
+        if(strand != nullptr)
+            return *strand;
+
+        std::lock_guard<std::mutex> lock(_order_lock);
+        strand = q._order.load(std::memory_order_relaxed);
+        if(strand == nullptr) {
+            _order.push_back(std::make_unique<boost::asio::io_service::strand>(_io));
+            strand = _order.back().get();
+            q._order.store(strand, std::memory_order_release);
+        }
+        return *strand;
+    }
+
+    // On the owner loop of q. A sequential reader past the middle of rb is
+    // likely to go on to the next block, read it in the pool before the
+    // reader gets there.
+    void prefetch(Queue& q, RecordsBlock& rb, size_t pos, bool sequential)
+    {
+        if(!sequential || pos - rb._first < (rb._last - rb._first) / 2)
+            return;
+
+        RecordsBlock* next = q.block(rb._last + 1);
+        if(next == nullptr || next->loaded() || next->_prefetching)
+            return;
+
+        next->_prefetching = true;
+        ++_prefetch_reads;
+
+        boost::asio::io_service& owner = _loops.owner(q);
+        _io.post([&q, next, &owner]() {
+            auto payload = std::make_shared<BlockPayload>();
+            try {
+                *payload = next->read();
+            } catch(std::exception& e) {
+                // the reader gets the error when it comes for the block
+                std::cerr << "prefetch error: " << e.what() << std::endl;
+            }
+
+            owner.post([&q, next, payload]() {
+                next->_prefetching = false;
+                if(!next->loaded() && payload->_wire != nullptr) {
+                    q.install(*next, std::move(*payload));
+                    next->_prefetched = true;
+                }
+                // on a failed read the waiters read the block themselves
+                auto waiters = std::move(next->_waiters);
+                next->_waiters.clear();
+                for(auto& waiter : waiters)
+                    waiter();
+            });
+        });
+    }
+
+public:
+    Storage(Loops& loops, size_t threads) :
+        _loops(loops),
+        _work(std::make_unique<boost::asio::io_service::work>(_io)),
+        _prefetch_reads(0),
+        _prefetch_hits(0),
+        _prefetch_misses(0),
+        _prefetch_waits(0)
+    {
+        for(size_t n = 0; n < threads; ++n)
+            _threads.emplace_back([this]() {
+                _io.run();
+            });
+    }
+
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+    ~Storage()
+    {
+        _work.reset();
+        for(auto& t : _threads)
+            t.join();
+    }
+
+    // the record becomes visible once it is on disk, a failed write leaves the
+    // queue as it was; returns the record position
+    size_t push(Queue& q, const std::string& data, boost::asio::io_service::strand& strand, boost::asio::yield_context& yield)
+    {
+        // positions are taken on the order strand, so records are appended
+        // to the owner loop in the order they were written
+        size_t pos = 0;
+        boost::asio::io_service& owner = _loops.owner(q);
+        hop(order(q), [&q, &data, &pos, &owner]() {
+            pos = q._stored;
+            uint64_t time = q.stamp();
+            Queue::write(q._name, pos, data, time);
+            ++q._stored;
+            owner.post([&q, &data, pos, time]() {
+                q.append(pos, data, time);
+            });
+        }, strand, yield);
+
+        // the owner runs the append before this, so data may go out of scope after it;
+        // the views stay valid, tail memory is released by seal() only
+        std::string name = q._name;
+        std::vector<RecordView> records;
+        _loops.own(q, [&]() {
+            if(q.full()) {
+                records = q.sealable();
+                q._sealing = true;
+            }
+        }, strand, yield);
+
+        if(records.empty())
+            return pos;
+
+        std::exception_ptr error;
+        size_t disk_bytes = 0;
+        try {
+            hop(order(q), [&name, &records, &disk_bytes]() {
+                disk_bytes = Queue::write_block(name, records);
+            }, strand, yield);
+        } catch(...) {
+            error = std::current_exception();
+        }
+
+        _loops.own(q, [&]() {
+            q._sealing = false;
+            if(!error)
+                q.seal(records.back()._pos, disk_bytes);
+        }, strand, yield);
+
+        if(error)
+            std::rethrow_exception(error);
+
+        return pos;
+    }
+
+    // the encoded record at pos, its block is read in the pool when it is
+    // not resident; ahead is the reader's own, one per cursor
+    Encoded wire(Queue& q, size_t pos, ReadAhead& ahead, boost::asio::io_service::strand& strand, boost::asio::yield_context& yield)
+    {
+        bool sequential = ahead.follows(q, pos);
+
+        Encoded data;
+        RecordsBlock* rb = nullptr;
+        bool waiting = false;
+        Signal prefetched(strand.get_io_service());
+        _loops.own(q, [&]() {
+            q._pops.add(now_ms());
+            rb = q.block(pos);
+            if(rb == nullptr || rb->loaded())
+                data = q.wire(pos);
+            if(rb != nullptr && rb->loaded()) {
+                if(rb->_prefetched) {
+                    rb->_prefetched = false;
+                    ++_prefetch_hits;
+                }
+                prefetch(q, *rb, pos, sequential);
+            } else if(rb != nullptr && rb->_prefetching) {
+                waiting = true;
+                rb->_waiters.push_back([&strand, &prefetched]() {
+                    strand.post([&prefetched]() {
+                        prefetched.notify();
+                    });
+                });
+            }
+        }, strand, yield);
+
+        if(!data.empty())
+            return data;
+
+        // the block is on its way already, a second read would only compete with it
+        if(waiting) {
+            ++_prefetch_waits;
+            prefetched.wait(yield);
+            _loops.own(q, [&]() {
+                if(rb->loaded()) {
+                    rb->_prefetched = false;
+                    data = q.wire(pos);
+                    prefetch(q, *rb, pos, sequential);
+                }
+            }, strand, yield);
+
+            if(!data.empty())
+                return data;
+        }
+
+        ++_prefetch_misses;
+
+        BlockPayload payload;
+        hop(_io, [rb, &payload]() {
+            payload = rb->read();
+        }, strand, yield);
+
+        _loops.own(q, [&]() {
+            // another session may have loaded it while this one was waiting
+            q.install(*rb, std::move(payload));
+            data = q.wire(pos);
+            prefetch(q, *rb, pos, sequential);
+        }, strand, yield);
+
+        return data;
+    }
+
+    // a miss is a block read the reader had to wait for, a wait is a
+    // reader that came for a block while its prefetch was in flight
+    metrics_t metrics() const
+    {
+        return {
+            {"storage.prefetch.reads", _prefetch_reads},
+            {"storage.prefetch.hits", _prefetch_hits},
+            {"storage.prefetch.misses", _prefetch_misses},
+            {"storage.prefetch.waits", _prefetch_waits}
+        };
+    }
+};
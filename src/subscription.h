@@ -0,0 +1,269 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include "queue.h"
+
+const size_t SUBSCRIBE_DEFAULT_CREDIT = 100;
+
+// '*' matches any run of characters, '?' matches exactly one
+bool glob_match(const std::string& pattern, const std::string& name)
+{
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, back = 0;
+    while(n < name.size()) {
+        if(p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            ++p;
+            ++n;
+        } else if(p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            back = n;
+        } else if(star != std::string::npos) {
+            p = star + 1;
+            n = ++back;
+        } else
+            return false;
+    }
+    while(p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+bool is_glob(const std::string& s)
+{
+    return s.find_first_of("*?") != std::string::npos;
+}
+
+// Puts a coroutine to sleep until a handler on the same strand wakes it,
+// a wake up that comes before the wait is not lost.
+class Signal
+{
+private:
+    boost::asio::deadline_timer _timer;
+    bool _pending;
+
+public:
+    explicit Signal(boost::asio::io_service& io) : _timer(io), _pending(false) {}
+
+    void wait(boost::asio::yield_context& yield)
+    {
+        if(!_pending) {
+            boost::system::error_code ec;
+            _timer.expires_at(boost::posix_time::ptime(boost::posix_time::pos_infin));
+            _timer.async_wait(yield[ec]);
+        }
+        _pending = false;
+    }
+
+    void notify()
+    {
+        _pending = true;
+        _timer.cancel();
+    }
+};
+
+struct Subscription {
+    QueuePtr _q;
+    size_t _p;
+};
+
+// State of SUBSCRIBE for one session: a cursor per followed queue, the globs
+// that pick up queues created later and the credit left to send records.
+// Everything but _active is touched on the session strand only, _strand is
+// a copy of that strand so it stays usable after the session is gone.
+struct Subscriber {
+    boost::asio::io_service::strand _strand;
+    std::vector<Subscription> _subs;
+    std::vector<std::string> _globs;
+    size_t _credit;
+    size_t _next;
+    std::atomic<bool> _active;
+    Signal _wake;
+
+    explicit Subscriber(boost::asio::io_service::strand& strand) :
+        _strand(strand), _credit(SUBSCRIBE_DEFAULT_CREDIT), _next(0), _active(true), _wake(strand.get_io_service())
+    {}
+
+    // CREDIT stops at SIZE_MAX instead of wrapping around
+    void credit(size_t n)
+    {
+        _credit = n > SIZE_MAX - _credit ? SIZE_MAX : _credit + n;
+    }
+
+    bool follows(const Queue& q) const
+    {
+        return std::any_of(_subs.begin(), _subs.end(), [&q](auto& s) {
+            return s._q->_id == q._id;
+        });
+    }
+
+    bool matches(const std::string& name) const
+    {
+        return std::any_of(_globs.begin(), _globs.end(), [&name](auto& g) {
+            return glob_match(g, name);
+        });
+    }
+
+    // next cursor with a record to send, queues take turns; each record takes a credit
+    bool ready(Subscription& next)
+    {
+        if(_credit == 0)
+            return false;
+
+        for(size_t n = 0; n < _subs.size(); ++n) {
+            Subscription& s = _subs[(_next + n) % _subs.size()];
+            if(s._p < s._q->_published.load(std::memory_order_acquire)) {
+                next = s;
+                ++s._p;
+                --_credit;
+                _next = (_next + n + 1) % _subs.size();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+using SubscriberPtr = std::shared_ptr<Subscriber>;
+
+// Who to wake when a queue gets a record. Sessions own their subscribers,
+// dead ones are dropped here lazily. Globs are matched against a queue once,
+// when the registry first sees it; after that a push only wakes the queue's
+// own followers. Pushes come from any loop, so every queue has a lock of its
+// own and subscribers are woken on their own strands.
+class Subscribers
+{
+private:
+    struct Watch {
+        std::string _glob;
+        std::weak_ptr<Subscriber> _sub;
+    };
+
+    struct Followers {
+        std::mutex _lock;
+        std::vector<std::weak_ptr<Subscriber>> _subs;
+    };
+
+    // guards the globs and the growth of _by_queue, a queue is resolved
+    // once its entry exists
+    std::shared_timed_mutex _lock;
+    std::vector<std::unique_ptr<Followers>> _by_queue;
+    std::vector<Watch> _globs;
+
+    static void collect(std::vector<std::weak_ptr<Subscriber>>& subs, std::vector<SubscriberPtr>& live)
+    {
+        subs.erase(std::remove_if(subs.begin(), subs.end(), [&live](auto& w) {
+            SubscriberPtr s = w.lock();
+            if(s == nullptr)
+                return true;
+            if(s->_active)
+                live.push_back(s);
+            return false;
+        }), subs.end());
+    }
+
+    // the followers of q; the first call matches the globs against q and
+    // returns the glob subscribers that have to start following it in found
+    Followers& followers(const Queue& q, std::vector<SubscriberPtr>& found)
+    {
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_lock);
+            if(q._id < _by_queue.size() && _by_queue[q._id] != nullptr)
+                return *_by_queue[q._id];
+        }
+
+        std::unique_lock<std::shared_timed_mutex> lock(_lock);
+        if(q._id >= _by_queue.size())
+            _by_queue.resize(q._id + 1);
+        if(_by_queue[q._id] == nullptr) {
+            auto f = std::make_unique<Followers>();
+            _globs.erase(std::remove_if(_globs.begin(), _globs.end(), [&q, &found, &f](auto& g) {
+                SubscriberPtr s = g._sub.lock();
+                if(s == nullptr)
+                    return true;
+                if(s->_active && glob_match(g._glob, q._name) &&
+                   std::find(found.begin(), found.end(), s) == found.end()) {
+                    found.push_back(s);
+                    f->_subs.push_back(s);
+                }
+                return false;
+            }), _globs.end());
+            _by_queue[q._id] = std::move(f);
+        }
+        return *_by_queue[q._id];
+    }
+
+    // glob subscribers that picked q up follow it from p on
+    void adopt(const std::vector<SubscriberPtr>& found, const QueuePtr& q, size_t p)
+    {
+        for(auto& s : found)
+            s->_strand.post([this, s, q, p]() {
+                this->follow(s, q, p);
+                s->_wake.notify();
+            });
+    }
+
+public:
+    // on the strand of s
+    void follow(const SubscriberPtr& s, const QueuePtr& q, size_t p)
+    {
+        if(s->follows(*q))
+            return;
+
+        s->_subs.push_back(Subscription{q, p});
+
+        std::vector<SubscriberPtr> found;
+        Followers& f = followers(*q, found);
+        {
+            std::lock_guard<std::mutex> lock(f._lock);
+            bool listed = std::any_of(f._subs.begin(), f._subs.end(), [&s](auto& w) {
+                return w.lock() == s;
+            });
+            if(!listed)
+                f._subs.push_back(s);
+        }
+
+        found.erase(std::remove(found.begin(), found.end(), s), found.end());
+        adopt(found, q, q->_published);
+    }
+
+    // on the strand of s; queues seen before are picked up by the caller
+    void watch(const SubscriberPtr& s, const std::string& glob)
+    {
+        s->_globs.push_back(glob);
+
+        std::unique_lock<std::shared_timed_mutex> lock(_lock);
+        _globs.push_back(Watch{glob, s});
+    }
+
+    // pos is the record just pushed to q, may be called from any loop
+    void notify(const QueuePtr& q, size_t pos)
+    {
+        std::vector<SubscriberPtr> found;
+        std::vector<SubscriberPtr> woken;
+        Followers& f = followers(*q, found);
+        {
+            std::lock_guard<std::mutex> lock(f._lock);
+            collect(f._subs, woken);
+        }
+
+        adopt(found, q, pos);
+
+        for(auto& s : woken)
+            if(std::find(found.begin(), found.end(), s) == found.end())
+                s->_strand.post([s]() {
+                    s->_wake.notify();
+                });
+    }
+};
@@ -12,13 +12,543 @@
 #include <fstream>
 
 #include <boost/timer/timer.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+
+#include "queue.h"
+#include "loops.h"
+#include "storage.h"
+#include "subscription.h"
+#include "ring.h"
+#include "command.h"
 
 BOOST_AUTO_TEST_SUITE( test_suite )
 
+// what a command needs of a session, on a single loop and with no peer
+struct CommandFixture {
+    Metrics _m;
+    Loops _loops;
+    Queues _qs;
+    Storage _st;
+    Subscribers _subs;
+    boost::asio::io_service::strand _strand;
+    Socket _socket;
+    std::shared_ptr<Outbound<Socket>> _out;
+    CommandState _s;
+
+    CommandFixture() :
+        _loops(1),
+        _st(_loops, 1),
+        _strand(_loops.at(0)),
+        _socket(_loops.at(0)),
+        _out(std::make_shared<Outbound<Socket>>(_socket, _strand, SESSION_MAX_OUTSTANDING)),
+        _s(_m, _qs, _st, _loops, _subs, *_out, _strand)
+    {}
+
+    // validate, then execute as a session does
+    std::string run(Command& c, std::vector<std::string> tokens)
+    {
+        std::string response = c.validate(tokens);
+        if(response.empty()) {
+            boost::asio::spawn(_strand, [&](boost::asio::yield_context yield) {
+                response = c.execute(tokens, yield);
+            });
+            _loops.at(0).run();
+            _loops.at(0).reset();
+        }
+        return response;
+    }
+};
+
 BOOST_AUTO_TEST_CASE( test_version )
 {
     BOOST_CHECK_GT(build_version(), 0);
 }
 
+BOOST_AUTO_TEST_CASE( test_records_tail )
+{
+    RecordsTail tail;
+    std::string big(RECORDS_TAIL_CHUNK_SIZE / 2, 'x');
+
+    tail.append(0, "a", 0);
+    tail.append(1, big, 1);
+    tail.append(2, big, 2);
+    tail.append(3, "b", 3);
+
+    BOOST_CHECK_EQUAL(tail.first(), 0);
+    BOOST_CHECK_EQUAL(tail.last(), 3);
+    BOOST_CHECK_EQUAL(tail.at(0)._data, "a");
+    BOOST_CHECK_EQUAL(tail.at(2)._data.size(), big.size());
+    BOOST_CHECK_EQUAL(tail.wire(3)._wire, "3\tb\n");
+
+    tail.release(1);
+    BOOST_CHECK_EQUAL(tail.first(), 2);
+    BOOST_CHECK_EQUAL(tail.at(3)._data, "b");
+    BOOST_CHECK(!tail.contains(1));
+
+    tail.release(3);
+    BOOST_CHECK(tail.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_queues_registry )
+{
+    Queues qs;
+    QueuePtr b = qs.queue("b");
+    QueuePtr a = qs.queue("a");
+
+    BOOST_CHECK_EQUAL(b->_id, 0);
+    BOOST_CHECK_EQUAL(a->_id, 1);
+    BOOST_CHECK(qs.queue("b") == b);
+    BOOST_CHECK(qs.find("a") == a);
+    BOOST_CHECK(qs.find("c") == nullptr);
+
+    std::vector<QueuePtr> queues = qs.list();
+    qs.queue("c");
+    BOOST_CHECK_EQUAL(queues.size(), 2);
+    BOOST_CHECK_EQUAL(queues.front()->_name, "a");
+    BOOST_CHECK_EQUAL(qs.list().size(), 3);
+    BOOST_CHECK_EQUAL(qs.list().back()->_name, "c");
+}
+
+BOOST_AUTO_TEST_CASE( test_queues_concurrent )
+{
+    // every thread looks up and adds the same names in its own order
+    const size_t threads = 8;
+    const size_t names = 500;
+    Queues qs;
+    std::vector<std::vector<QueuePtr>> got(threads, std::vector<QueuePtr>(names));
+    std::vector<std::thread> ts;
+    for(size_t t = 0; t < threads; ++t)
+        ts.emplace_back([&qs, &got, t, names]() {
+            for(size_t n = 0; n < names; ++n) {
+                size_t k = (n * 7 + t * 131) % names;
+                std::string name = "q" + std::to_string(k);
+                QueuePtr found = qs.find(name);
+                got[t][k] = qs.queue(name);
+                if(found != nullptr && found != got[t][k])
+                    got[t][k] = nullptr;
+            }
+        });
+    for(auto& th : ts)
+        th.join();
+
+    std::vector<QueuePtr> queues = qs.list();
+    BOOST_REQUIRE_EQUAL(queues.size(), names);
+    std::vector<bool> ids(names, false);
+    for(auto& q : queues) {
+        BOOST_REQUIRE_LT(q->_id, names);
+        BOOST_CHECK(!ids[q->_id]);
+        ids[q->_id] = true;
+    }
+    for(size_t k = 0; k < names; ++k) {
+        QueuePtr q = qs.find("q" + std::to_string(k));
+        for(size_t t = 0; t < threads; ++t)
+            BOOST_CHECK(got[t][k] == q);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_queue_seek )
+{
+    Queue q("q", 0);
+    for(size_t pos = 0; pos < 6; ++pos)
+        q._tail.append(pos, "x", 100 + pos / 2 * 10);
+
+    q.seal(1, 0);
+    q.seal(3, 0);
+    BOOST_CHECK_EQUAL(q._block_times.size(), 2);
+    BOOST_CHECK_EQUAL(q._blocks.back()._times.size(), 1);
+
+    BOOST_CHECK_EQUAL(q.seek(0), 0);
+    BOOST_CHECK_EQUAL(q.seek(100), 0);
+    BOOST_CHECK_EQUAL(q.seek(101), 2);
+    BOOST_CHECK_EQUAL(q.seek(110), 2);
+    BOOST_CHECK_EQUAL(q.seek(111), 4);
+    BOOST_CHECK_EQUAL(q.seek(120), 4);
+    BOOST_CHECK_EQUAL(q.seek(121), 6);
+}
+
+BOOST_AUTO_TEST_CASE( test_storage_push_failure )
+{
+    Loops loops(1);
+    Storage st(loops, 1);
+    boost::asio::io_service::strand strand(loops.at(0));
+
+    // there is no such directory, the write fails
+    Queue q("missing/q", 0);
+    bool failed = false;
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        try {
+            st.push(q, "x", strand, yield);
+        } catch(std::exception&) {
+            failed = true;
+        }
+    });
+    loops.at(0).run();
+
+    BOOST_CHECK(failed);
+    BOOST_CHECK(q.empty());
+    BOOST_CHECK_EQUAL(q._published, 0);
+    BOOST_CHECK_EQUAL(q._stored, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_queue_accounting )
+{
+    Rate r;
+    r.add(1000);
+    r.add(1500);
+    BOOST_CHECK_EQUAL(r.per_second(1999), 0);
+    BOOST_CHECK_EQUAL(r.per_second(2000), 2);
+    BOOST_CHECK_EQUAL(r.per_second(3000), 0);
+
+    Queue q("q", 0);
+    q._tail.append(0, "abc", 100);
+    q._tail.append(1, "de", 100);
+    BOOST_CHECK_EQUAL(q.files(), 2);
+    BOOST_CHECK_EQUAL(q.disk_bytes(), 15);
+    BOOST_CHECK_GE(q.resident(), RECORDS_TAIL_CHUNK_SIZE);
+
+    q.seal(0, 42);
+    BOOST_CHECK_EQUAL(q.files(), 3);
+    BOOST_CHECK_EQUAL(q.disk_bytes(), 49);
+
+    size_t tail = q.resident();
+    RecordsBlock& rb = q._blocks.back();
+    q.install(rb, BlockPayload{std::make_shared<const std::string>("0\tabc\n"), {0, 6}, 0});
+    BOOST_CHECK(rb.loaded());
+    BOOST_CHECK_EQUAL(q.resident(), tail + rb.resident());
+    q.unload(rb);
+    BOOST_CHECK_EQUAL(q.resident(), tail);
+}
+
+BOOST_AUTO_TEST_CASE( test_glob_match )
+{
+    BOOST_CHECK(glob_match("*", ""));
+    BOOST_CHECK(glob_match("*", "abc"));
+    BOOST_CHECK(glob_match("a?c", "abc"));
+    BOOST_CHECK(!glob_match("a?c", "ac"));
+    BOOST_CHECK(glob_match("ab*", "ab"));
+    BOOST_CHECK(glob_match("ab*", "abxyz"));
+    BOOST_CHECK(!glob_match("ab*", "a"));
+    BOOST_CHECK(glob_match("a*b*c", "aXbYbc"));
+    BOOST_CHECK(!glob_match("a*b*c", "aXbYbd"));
+    BOOST_CHECK(!glob_match("abc", "abcd"));
+}
+
+BOOST_AUTO_TEST_CASE( test_subscriber_ready )
+{
+    boost::asio::io_service io;
+    boost::asio::io_service::strand strand(io);
+    Subscriber sub(strand);
+    sub._credit = 3;
+
+    QueuePtr a = std::make_shared<Queue>("a", 0);
+    QueuePtr b = std::make_shared<Queue>("b", 1);
+    a->_published = 2;
+    b->_published = 2;
+    sub._subs.push_back(Subscription{a, 0});
+    sub._subs.push_back(Subscription{b, 0});
+
+    // queues take turns until the credit runs out
+    std::vector<std::string> sent;
+    Subscription next;
+    while(sub.ready(next))
+        sent.push_back(next._q->_name + std::to_string(next._p));
+    BOOST_CHECK((sent == std::vector<std::string>{"a0", "b0", "a1"}));
+    BOOST_CHECK_EQUAL(sub._credit, 0);
+
+    sub._credit = 5;
+    BOOST_CHECK(sub.ready(next));
+    BOOST_CHECK_EQUAL(next._q->_name + std::to_string(next._p), "b1");
+    BOOST_CHECK(!sub.ready(next));
+    BOOST_CHECK_EQUAL(sub._credit, 4);
+}
+
+BOOST_AUTO_TEST_CASE( test_ring )
+{
+    const uint32_t slots = 8;
+    std::vector<uint64_t> memory(Ring::size(slots, 64) / sizeof(uint64_t) + 1);
+    Ring ring(memory.data(), slots, 64);
+    ring.init();
+
+    std::string name, data;
+    BOOST_CHECK(!ring.pop(name, data));
+    BOOST_CHECK(!ring.push("q", std::string(ring.capacity(), 'x')));
+
+    const size_t count = 10000;
+    std::thread producers[2];
+    for(size_t p = 0; p < 2; ++p)
+        producers[p] = std::thread([&ring, p]() {
+            for(size_t n = 0; n < count; ++n)
+                while(!ring.push("q" + std::to_string(p), std::to_string(n)))
+                    std::this_thread::yield();
+        });
+
+    size_t next[2] = {0, 0};
+    for(size_t received = 0; received < 2 * count; )
+        if(ring.pop(name, data)) {
+            size_t p = name == "q0" ? 0 : 1;
+            BOOST_REQUIRE_EQUAL(data, std::to_string(next[p]));
+            ++next[p];
+            ++received;
+        }
+
+    for(auto& t : producers)
+        t.join();
+    BOOST_CHECK(!ring.pop(name, data));
+
+    // sizes a producer wrote past its slot are not trusted
+    BOOST_REQUIRE(ring.push("q", "x"));
+    char* slot = reinterpret_cast<char*>(memory.data()) + sizeof(RingHeader) + (2 * count % slots) * 64;
+    reinterpret_cast<RingSlot*>(slot)->_data_size = 1 << 30;
+    BOOST_CHECK(ring.pop(name, data));
+    BOOST_CHECK(name.empty() && data.empty());
+    BOOST_CHECK(!ring.pop(name, data));
+}
+
+BOOST_AUTO_TEST_CASE( test_command_credit )
+{
+    CommandFixture f;
+    CCredit credit(f._s);
+    BOOST_CHECK_EQUAL(f.run(credit, {"CREDIT", "1"}), "ERR not subscribed");
+
+    f._s._sub = std::make_shared<Subscriber>(f._strand);
+    BOOST_CHECK_EQUAL(f.run(credit, {"CREDIT", "99999999999999999999999999"}), "ERR credit must have positive integer value");
+    BOOST_CHECK_EQUAL(f._s._sub->_credit, SUBSCRIBE_DEFAULT_CREDIT);
+
+    BOOST_CHECK_EQUAL(f.run(credit, {"CREDIT", "18446744073709551615"}), "");
+    BOOST_CHECK_EQUAL(f._s._sub->_credit, SIZE_MAX);
+    BOOST_CHECK_EQUAL(f.run(credit, {"CREDIT", "5"}), "");
+    BOOST_CHECK_EQUAL(f._s._sub->_credit, SIZE_MAX);
+}
+
+BOOST_AUTO_TEST_CASE( test_command_use )
+{
+    CommandFixture f;
+    CUse use(f._s);
+    f._qs.queue("u1")->_tail.append(0, "a", 100);
+
+    const std::string bad_pos = "ERR queue pos must have positive integer, '@unix_ms', 'NEW', LAST' or 'FIRST' value";
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u1", "@99999999999999999999999"}), bad_pos);
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u1", "99999999999999999999999"}), bad_pos);
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u\xff"}), "ERR invalid queue name");
+
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u1", "@100"}), "");
+    BOOST_CHECK_EQUAL(f._s._p, 0);
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u1", "@18446744073709551615"}), "");
+    BOOST_CHECK_EQUAL(f._s._p, 1);
+    BOOST_CHECK_EQUAL(f.run(use, {"USE", "u1", "7"}), "");
+    BOOST_CHECK_EQUAL(f._s._p, 7);
+}
+
+BOOST_AUTO_TEST_CASE( test_read_ahead_follows )
+{
+    Queue a("a", 0);
+    Queue b("b", 1);
+    ReadAhead ahead;
+    BOOST_CHECK(!ahead.follows(a, 0));
+    BOOST_CHECK(ahead.follows(a, 1));
+    BOOST_CHECK(!ahead.follows(a, 3));
+    BOOST_CHECK(!ahead.follows(b, 4));
+    BOOST_CHECK(ahead.follows(b, 5));
+}
+
+BOOST_AUTO_TEST_CASE( test_storage_prefetch )
+{
+    Loops loops(1);
+    Storage st(loops, 1);
+    boost::asio::io_service::strand strand(loops.at(0));
+
+    // two sealed blocks of five records, neither of them loaded
+    Queue q("test_prefetch", 0);
+    for(size_t pos = 0; pos < 10; ++pos)
+        q._tail.append(pos, "r" + std::to_string(pos), 100);
+    for(size_t last : {4, 9}) {
+        std::vector<RecordView> records = q.sealable();
+        records.resize(5);
+        q.seal(last, Queue::write_block(q._name, records));
+    }
+
+    std::vector<std::string> got;
+    std::vector<metrics_t> seen;
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        ReadAhead ahead;
+        for(size_t pos : {0, 3, 4, 5}) {
+            got.push_back(st.wire(q, pos, ahead, strand, yield)._wire.to_string());
+            seen.push_back(st.metrics());
+        }
+    });
+    loops.at(0).run();
+
+    BOOST_CHECK((got == std::vector<std::string>{"0\tr0\n", "3\tr3\n", "4\tr4\n", "5\tr5\n"}));
+    BOOST_REQUIRE_EQUAL(seen.size(), 4);
+    // past the middle of the block, but 3 does not follow 0
+    BOOST_CHECK_EQUAL(seen[1]["storage.prefetch.reads"], 0);
+    // a sequential reader past the middle reads the next block ahead
+    BOOST_CHECK_EQUAL(seen[2]["storage.prefetch.reads"], 1);
+    // the read ahead is still in flight, it is installed by this very loop,
+    // so the reader waits for it instead of reading the block again
+    BOOST_CHECK_EQUAL(seen[3]["storage.prefetch.waits"], 1);
+    BOOST_CHECK_EQUAL(seen[3]["storage.prefetch.misses"], 1);
+    BOOST_CHECK(q._blocks.back().loaded());
+
+    for(auto& rb : q._blocks) {
+        boost::filesystem::remove(rb._path);
+        boost::filesystem::remove(RecordsBlock::times_path(rb._name, rb._first, rb._last));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_limits_admit )
+{
+    Limits limits;
+    limits._max_connections = 2;
+    BOOST_CHECK(limits.admit());
+    BOOST_CHECK(limits.admit());
+    BOOST_CHECK(!limits.admit());
+    BOOST_CHECK_EQUAL(limits._connections, 2);
+    limits.leave();
+    BOOST_CHECK(limits.admit());
+    BOOST_CHECK(!limits.admit());
+
+    Limits unlimited;
+    for(size_t n = 0; n < 100; ++n)
+        BOOST_CHECK(unlimited.admit());
+}
+
+BOOST_AUTO_TEST_CASE( test_outbound )
+{
+    using Local = boost::asio::local::stream_protocol::socket;
+    boost::asio::io_service io;
+    boost::asio::io_service::strand strand(io);
+    Local ours(io);
+    Local peer(io);
+    boost::asio::local::connect_pair(ours, peer);
+
+    auto out = std::make_shared<Outbound<Local>>(ours, strand, 1024);
+    const std::string big(1 << 20, 'b');
+    std::vector<std::string> events;
+    boost::system::error_code write_ec;
+    boost::system::error_code drain_ec;
+
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        // below the limit a write only queues
+        out->write(std::string(512, 's'), yield, write_ec);
+        events.push_back("small");
+        // above it the writer waits until the peer took enough
+        out->write(big, yield, write_ec);
+        events.push_back("big");
+        out->write("e", yield, write_ec);
+        out->drain(yield, drain_ec);
+        events.push_back("drained");
+    });
+
+    std::string received;
+    std::vector<std::string> seen;
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        seen = events;
+        received.resize(512 + big.size() + 1);
+        boost::system::error_code ec;
+        boost::asio::async_read(peer, boost::asio::buffer(&received[0], received.size()), yield[ec]);
+    });
+    io.run();
+
+    BOOST_CHECK((seen == std::vector<std::string>{"small"}));
+    BOOST_CHECK((events == std::vector<std::string>{"small", "big", "drained"}));
+    BOOST_CHECK(!write_ec);
+    BOOST_CHECK(!drain_ec);
+    BOOST_CHECK(received == std::string(512, 's') + big + "e");
+    BOOST_CHECK(!out->stalled());
+
+    // a peer that is gone fails the write, drain reports it
+    peer.close();
+    io.reset();
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        out->write(big, yield, write_ec);
+        out->drain(yield, drain_ec);
+    });
+    io.run();
+    BOOST_CHECK(drain_ec);
+}
+
+BOOST_AUTO_TEST_CASE( test_loops_own )
+{
+    Loops loops(2);
+    auto work = std::make_unique<boost::asio::io_service::work>(loops.at(0));
+    std::thread owner([&]() {
+        loops.at(0).run();
+    });
+    std::thread::id owner_id = owner.get_id();
+
+    // q belongs to loop 0, the coroutine runs on loop 1
+    Queue q("q", 0);
+    Queue mine("mine", 1);
+    boost::asio::io_service::strand strand(loops.at(1));
+    std::thread::id ran;
+    std::thread::id ran_inline;
+    std::string caught;
+    boost::asio::spawn(strand, [&](boost::asio::yield_context yield) {
+        loops.own(q, [&]() {
+            ran = std::this_thread::get_id();
+        }, strand, yield);
+        try {
+            loops.own(q, []() {
+                throw std::runtime_error("owner failed");
+            }, strand, yield);
+        } catch(std::runtime_error& e) {
+            caught = e.what();
+        }
+        loops.own(mine, [&]() {
+            ran_inline = std::this_thread::get_id();
+        }, strand, yield);
+    });
+    loops.at(1).run();
+
+    work.reset();
+    owner.join();
+
+    BOOST_CHECK(ran == owner_id);
+    BOOST_CHECK(ran_inline == std::this_thread::get_id());
+    BOOST_CHECK_EQUAL(caught, "owner failed");
+}
+
+BOOST_AUTO_TEST_CASE( test_subscribers_globs )
+{
+    boost::asio::io_service io;
+    boost::asio::io_service::strand strand(io);
+    Subscribers subs;
+    auto globbed = std::make_shared<Subscriber>(strand);
+    auto named = std::make_shared<Subscriber>(strand);
+    subs.watch(globbed, "a*");
+
+    QueuePtr ab = std::make_shared<Queue>("ab", 0);
+    QueuePtr b = std::make_shared<Queue>("b", 1);
+
+    // the first push to a queue matches the globs, the glob subscriber follows from there
+    subs.notify(ab, 3);
+    subs.notify(b, 0);
+    io.run();
+    BOOST_REQUIRE_EQUAL(globbed->_subs.size(), 1);
+    BOOST_CHECK_EQUAL(globbed->_subs[0]._q->_name, "ab");
+    BOOST_CHECK_EQUAL(globbed->_subs[0]._p, 3);
+
+    // later pushes only wake the followers, nobody follows twice
+    subs.follow(named, ab, 4);
+    subs.notify(ab, 4);
+    io.reset();
+    io.run();
+    BOOST_CHECK_EQUAL(globbed->_subs.size(), 1);
+    BOOST_CHECK_EQUAL(globbed->_subs[0]._p, 3);
+    BOOST_CHECK_EQUAL(named->_subs.size(), 1);
+
+    // following a queue nobody pushed to yet resolves the globs as well
+    QueuePtr ac = std::make_shared<Queue>("ac", 2);
+    ac->_published = 7;
+    subs.follow(named, ac, 7);
+    io.reset();
+    io.run();
+    BOOST_REQUIRE_EQUAL(globbed->_subs.size(), 2);
+    BOOST_CHECK_EQUAL(globbed->_subs[1]._q->_name, "ac");
+    BOOST_CHECK_EQUAL(globbed->_subs[1]._p, 7);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 